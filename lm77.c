@@ -37,6 +37,18 @@
 #include <linux/i2c.h>
 #include <linux/i2c-proc.h>
 #include <linux/init.h>
+#include <linux/list.h>
+#include <linux/sched.h>
+#include <linux/smp.h>
+#include <linux/cache.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/interrupt.h>
+#include <linux/tqueue.h>
+#include <linux/mm.h>
+#include <linux/proc_fs.h>
+#include <asm/uaccess.h>
+#include <asm/io.h>
 #include "version.h"
 #include "lm77.h"
 
@@ -49,10 +61,219 @@ static unsigned int normal_isa_range[] = { SENSORS_ISA_END };
 /* Insmod parameters */
 SENSORS_INSMOD_1(lm77);
 
+/* The limit registers only change when we write them, so they are read
+   once at attach time and then kept current by lm77_proc_temp(). Set this
+   to re-read them from the chip every so many seconds anyway. */
+static int limit_resync = 0;
+MODULE_PARM(limit_resync, "i");
+MODULE_PARM_DESC(limit_resync, "Re-read the limit registers every n seconds "
+		 "(0 = never)");
+
+/* With a non-zero sample_interval a kernel thread refreshes all clients
+   periodically, and readers only ever copy the latest published sample
+   instead of doing bus I/O themselves. */
+static int sample_interval = 0;
+MODULE_PARM(sample_interval, "i");
+MODULE_PARM_DESC(sample_interval, "Refresh all sensors from a kernel thread "
+		 "every n milliseconds (0 = refresh on read)");
+
+/* Detection. The aliasing check (registers repeat every 8 addresses) is by
+   far the most expensive part, see lm77_detect() for the modes. */
+static int detect_mode = 0;
+MODULE_PARM(detect_mode, "i");
+MODULE_PARM_DESC(detect_mode, "0 = check all 31 register mirrors (strict), "
+		 "1 = check only detect_blocks of them (fast)");
+
+static int detect_blocks = 6;
+MODULE_PARM(detect_blocks, "i");
+MODULE_PARM_DESC(detect_blocks, "Number of register mirrors checked in fast "
+		 "detection mode (1-31, default 6)");
+
+SENSORS_MODULE_PARM(known, "List of adapter,address pairs known to carry an "
+		    "LM77; only the register contents are checked there");
+
+/* Warm attach, for reloading the driver on a running system: addresses
+   in this list are taken on trust without any probing, the chip is left
+   configured as it is if that is what we would write anyway, and the
+   first sample comes from the same batched read as the limits. Only
+   addresses that are scanned (or given in probe) are looked at. */
+SENSORS_MODULE_PARM(warm, "List of adapter,address pairs to attach without "
+		    "probing or reinitializing the LM77");
+
+/* Adapter filters, applied before anything else (including force and
+   known). Each is a comma separated list of bus numbers and adapter
+   names; a name matches every adapter whose name contains it. If
+   adapters is given, all other adapters are left alone. */
+static char *adapters = NULL;
+MODULE_PARM(adapters, "s");
+MODULE_PARM_DESC(adapters, "Only probe these adapters (numbers or names)");
+
+static char *skip_adapters = NULL;
+MODULE_PARM(skip_adapters, "s");
+MODULE_PARM_DESC(skip_adapters, "Never probe these adapters (numbers or "
+		 "names)");
+
+/* Adapter/address pairs that failed detection are remembered and not
+   probed again when the adapter comes back or is rescanned. Forced
+   addresses are always probed. */
+static int negative_cache = 1;
+MODULE_PARM(negative_cache, "i");
+MODULE_PARM_DESC(negative_cache, "Do not probe an address again after "
+		 "detection failed there (default 1)");
+
+/* Adapters that can do plain I2C get register reads as one combined
+   write+read transfer, and repeated reads of the same register skip the
+   pointer write altogether. The latter assumes that nobody but this driver
+   talks to the chip (e.g. through i2c-dev). */
+static int smbus_only = 0;
+MODULE_PARM(smbus_only, "i");
+MODULE_PARM_DESC(smbus_only, "Always use SMBus transfers, never plain I2C");
+
+/* Read back the limit registers that lm77_proc_temp() actually changed */
+static int verify_writes = 0;
+MODULE_PARM(verify_writes, "i");
+MODULE_PARM_DESC(verify_writes, "Read back changed limit registers");
+
+/* Bus errors. A failed register access is retried up to retries times,
+   waiting LM77_RETRY_MS, then twice that and so on in between. If a
+   refresh still fails, the previous readings are kept and marked stale.
+   After error_budget failed refreshes in a row, the client is refreshed
+   less and less often, so that a dead chip does not hog the bus. */
+static int retries = 2;
+MODULE_PARM(retries, "i");
+MODULE_PARM_DESC(retries, "Retries of a failed register access (default 2)");
+
+static int error_budget = 3;
+MODULE_PARM(error_budget, "i");
+MODULE_PARM_DESC(error_budget, "Failed refreshes before backing off "
+		 "(0 = never, default 3)");
+
+/* Interrupt driven alarms. If the INT output of the LM77 at 0x48 + n is
+   wired to an interrupt line, give its number as irq[n]; the chip is then
+   put into interrupt mode and the alarm state is refreshed whenever INT
+   fires. T_CRIT_A always works in comparator mode, so if it shares the line
+   an edge triggered interrupt is strongly recommended. */
+static int irq[4] = { 0, 0, 0, 0 };
+MODULE_PARM(irq, "1-4i");
+MODULE_PARM_DESC(irq, "IRQ wired to INT of the LM77 at 0x48, 0x49, 0x4a and "
+		 "0x4b (0 = none)");
+
+static int int_active_high = 0;
+MODULE_PARM(int_active_high, "i");
+MODULE_PARM_DESC(int_active_high, "INT output is active high (default: low)");
+
+static int tcrit_active_high = 0;
+MODULE_PARM(tcrit_active_high, "i");
+MODULE_PARM_DESC(tcrit_active_high, "T_CRIT_A output is active high "
+		 "(default: low)");
+
+/* Probe new adapters from a kernel thread instead of the context that
+   registered them (insmod, or the adapter driver for later adapters).
+   The sysctl directories and device slots appear once probing is done. */
+static int async_probe = 0;
+MODULE_PARM(async_probe, "i");
+MODULE_PARM_DESC(async_probe, "Probe adapters in the background");
+
+/* Alarm filtering. The fault queue of the chip (section 1.7 of the data
+   sheet) only trips an output after four consecutive conversions beyond
+   a limit. alarm_debounce does the same in software for the alarm bits
+   the driver reports: a change is only published once it has been seen
+   in that many refreshes in a row. Both can be changed per client
+   through alarm_filter. Building with -DLM77_FAULT_QUEUE turns the fault
+   queue on by default. */
+#ifdef LM77_FAULT_QUEUE
+static int fault_queue = 1;
+#else
+static int fault_queue = 0;
+#endif
+MODULE_PARM(fault_queue, "i");
+MODULE_PARM_DESC(fault_queue, "Enable the fault queue of the chip");
+
+static int alarm_debounce = 0;
+MODULE_PARM(alarm_debounce, "i");
+MODULE_PARM_DESC(alarm_debounce, "Refreshes an alarm change must persist "
+		 "before it is reported (0 = none)");
+
+/* The event device reports alarm changes and, if event_delta is not 0,
+   every change of the temperature by at least that many tenths of a
+   degree */
+static int event_delta = 10;
+MODULE_PARM(event_delta, "i");
+MODULE_PARM_DESC(event_delta, "Temperature change (in 0.1 deg) reported on "
+		 "the event device (0 = none, default 10)");
+
+/* Record every register transfer in /proc/driver/lm77/trace. Writing 1
+   or 0 to that file starts (and clears) or stops tracing at run time. */
+static int trace = 0;
+MODULE_PARM(trace, "i");
+MODULE_PARM_DESC(trace, "Trace register transfers from the start");
+
+/* Report temperatures in millidegrees (no decimals) instead of tenths of
+   a degree, in the sysctl files and in /proc/driver/lm77/sensors. This
+   is what the 2.6 hwmon drivers do. The binary interfaces (ioctl, event
+   and change log devices) are not affected. */
+static int millidegree = 0;
+MODULE_PARM(millidegree, "i");
+MODULE_PARM_DESC(millidegree, "Report temperatures in millidegrees celsius");
+
+/* Guard band mode, for clients with INT wired (see irq): instead of
+   polling, T_LOW and T_HIGH are set to this many tenths of a degree
+   around the last reading, and INT tells when the temperature left that
+   band. The limits written through the sysctl files are kept by the
+   driver and put back when the mode is turned off; T_CRIT is never
+   touched. Can be changed per client through guard_band.
+   Once INT fired on an edge, the chip only fires for it again after the
+   temperature came back by T_HYST. The band edges are therefore kept
+   more than T_HYST away from the reading: the re-arm then happens right
+   after the band moved, at the cost of one extra interrupt. A real
+   limit closer to the reading than that is noticed up to T_HYST late. */
+static int guard_band = 0;
+MODULE_PARM(guard_band, "i");
+MODULE_PARM_DESC(guard_band, "Watch for changes of this many tenths of a "
+		 "degree through INT instead of polling (0 = off)");
+
+/* Keep the chip shut down and wake it up for a single conversion whenever
+   a sample is taken. Can be changed per client through duty_cycle. */
+static int duty_cycle = 0;
+MODULE_PARM(duty_cycle, "i");
+MODULE_PARM_DESC(duty_cycle, "Shut the chip down between samples (default: "
+		 "convert continuously)");
+
+/* Each client can keep the last history_size raw readings, see struct
+   lm77_history in lm77.h. The value is rounded up to a power of two. */
+static int history_size = 0;
+MODULE_PARM(history_size, "i");
+MODULE_PARM_DESC(history_size, "Number of samples kept per sensor for the "
+		 "history device (0 = none)");
+
+/* Time constants of the three moving averages in temp_avg, in seconds */
+static int ewma_tau[3] = { 60, 300, 900 };
+MODULE_PARM(ewma_tau, "1-3i");
+MODULE_PARM_DESC(ewma_tau, "Time constants of the temp_avg averages in "
+		 "seconds (default 60,300,900)");
+
+/* Each client can also keep a log of changes only, see struct
+   lm77_changes in lm77.h. A flat temperature costs nothing there, so a
+   few KB last for hours. Rounded up to whole blocks. */
+static int change_log = 0;
+MODULE_PARM(change_log, "i");
+MODULE_PARM_DESC(change_log, "Bytes of change log kept per sensor for the "
+		 "changes device (0 = none)");
+
+/* Major number of the lm77 character devices; 0 picks one dynamically */
+static int lm77_major = 0;
+MODULE_PARM(lm77_major, "i");
+MODULE_PARM_DESC(lm77_major, "Major device number (0 = dynamic)");
+
 /* Whether or not to compile with debugging extensions */
 /* #define DEBUG 1 */
 #undef DEBUG
 
+/* Define this at compile time in order to get per-client performance
+   counters in /proc/driver/lm77/stats. Without it they cost nothing. They
+   are kept per CPU, which costs NR_CPUS cache lines per client. */
+/* #define LM77_STATS 1 */
+
 /* The LM77 registers */
 #define LM77_REG_TEMP 0x00		/* Current temperature (read-only) */
 #define LM77_REG_CONF 0x01		/* Configuration (read-write) */
@@ -93,38 +314,599 @@ SENSORS_INSMOD_1(lm77);
 /* mask for the alarm bits in LM77_REG_TEMP */
 #define LM77_ALARM_MASK 0x0007
 
+/* Cache lifetime. The default matches what the driver always used. In
+   adaptive mode the interval drops to a quarter while the temperature
+   moves or is within LM77_ADAPT_MARGIN of temp_max or temp_crit, and
+   doubles with every unchanged reading up to four times the base. */
+#define LM77_DEFAULT_INTERVAL (HZ + HZ / 2)
+#define LM77_MIN_INTERVAL_MS 100	/* One conversion takes about that */
+#define LM77_MAX_INTERVAL_MS 600000
+#define LM77_ADAPT_MARGIN 20		/* 2 deg celsius */
+
+#define LM77_MAX_DEBOUNCE 100
+
+#define LM77_RETRY_MS 2
+#define LM77_MAX_BACKOFF 6		/* interval << 6 at most */
+
+/* The sampler refreshes every client that is due within this window of
+   the first one in the same pass, so that they share one bus burst */
+#define LM77_COALESCE_MS 20
+
+/* How long a duty cycled chip is left running for one sample */
+#define LM77_CONV_MS (LM77_MIN_INTERVAL_MS + 20)
+
+/* A running chip finishes a conversion every conv_period, which starts
+   out as LM77_MIN_INTERVAL_MS and is measured as it goes, see
+   lm77_conv_seen(). It is kept in 1/(1 << LM77_CONV_SHIFT) jiffies. A
+   phase older than LM77_CONV_STEPS periods is not trusted any more. */
+#define LM77_CONV_SHIFT 8
+#define LM77_CONV_STEPS 64
+
+/* In guard band mode the reading is refreshed this often anyway, in case
+   an interrupt got lost */
+#define LM77_GUARD_INTERVAL (LM77_MAX_INTERVAL_MS / 1000 * HZ)
+
+/* Indices into the limit_regs of a chip, in the order of the sysctl
+   files and lm77_proc_temp() */
+#define LM77_LIM_MIN 0
+#define LM77_LIM_MAX 1
+#define LM77_LIM_CRIT 2
+#define LM77_LIM_HYST 3
+#define LM77_LIMITS 4
+
+/* What the register access and refresh code needs to know about a chip,
+   indexed by kind. Only the LM77 is detected so far. As long as there is
+   just one kind, lm77_chip() does not look at the client, so every field
+   is a compile time constant and the table costs nothing. Registers are
+   0 to nregs - 1; temperature registers are converted by the hooks, to
+   and from tenths of a degree unless they say otherwise. */
+struct lm77_chip {
+	const char *type_name;
+	const char *client_name;
+	u8 nregs;			/* At most LM77_NUM_REGS */
+	u8 byte_regs;			/* Bit per 8-bit register */
+	u8 limit_regs[LM77_LIMITS];	/* Indexed by LM77_LIM_* */
+	u8 alarm_mask;			/* Alarm bits in the TEMP register */
+	u8 step;			/* Resolution, in tenths */
+	s16 (*to_reg)(int temp);
+	int (*from_reg)(s16 reg);
+	s16 (*to_reg_mc)(long temp);	/* In millidegrees */
+	long (*from_reg_mc)(s16 reg);	/* In millidegrees */
+};
+
+#define LM77_KINDS 1
+
+static const struct lm77_chip lm77_chips[LM77_KINDS + 1] = {
+	[lm77] = {
+		.type_name	= "lm77",
+		.client_name	= "LM77 chip",
+		.nregs		= 6,
+		.byte_regs	= 1 << LM77_REG_CONF,
+		.limit_regs	= {
+			[LM77_LIM_MIN]	= LM77_REG_T_LOW,
+			[LM77_LIM_MAX]	= LM77_REG_T_HIGH,
+			[LM77_LIM_CRIT]	= LM77_REG_T_CRIT,
+			[LM77_LIM_HYST]	= LM77_REG_T_HYST,
+		},
+		.alarm_mask	= LM77_ALARM_MASK,
+		.step		= 5,
+		.to_reg		= LM77_TEMP_TO_REG,
+		.from_reg	= LM77_TEMP_FROM_REG,
+		.to_reg_mc	= LM77_TEMP_TO_REG_MC,
+		.from_reg_mc	= LM77_TEMP_FROM_REG_MC,
+	},
+};
+
+/* Order in which the register mirrors are checked during detection. The
+   first five toggle one of the address bits 3 to 7 each, the sixth all of
+   them at once; see lm77_detect() */
+static const u8 lm77_mirror_order[31] = {
+	0x80, 0x40, 0x20, 0x10, 0x08, 0xf8, 0x18, 0x28,
+	0x30, 0x38, 0x48, 0x50, 0x58, 0x60, 0x68, 0x70,
+	0x78, 0x88, 0x90, 0x98, 0xa0, 0xa8, 0xb0, 0xb8,
+	0xc0, 0xc8, 0xd0, 0xd8, 0xe0, 0xe8, 0xf0
+};
+
+/* First address an LM77 can live at; irq[] is indexed relative to it */
+#define LM77_ADDR_BASE 0x48
+
+/* Size of the negative probe cache; the oldest entry is replaced */
+#define LM77_NEG_CACHE 16
+
+/* Every client gets a slot, which determines the minor numbers of its
+   character devices: minor = (slot << LM77_MINOR_SHIFT) | node. */
+#define LM77_MAX_CLIENTS 32
+#define LM77_MINOR_SHIFT 3
+#define LM77_NODE_MASK ((1 << LM77_MINOR_SHIFT) - 1)
+
+/* read() returns one byte of LM77_ALARM_* bits whenever it changed since
+   the last read on this file; poll() signals readability accordingly */
+#define LM77_NODE_ALARMS 0
+/* mmap() gives read-only access to the sample history */
+#define LM77_NODE_HISTORY 1
+/* read() returns struct lm77_event records, see lm77.h; poll() and
+   SIGIO (through fasync) tell when there are new ones */
+#define LM77_NODE_EVENTS 2
+
+/* read() returns the change log, see struct lm77_changes in lm77.h. It
+   is copied when the device is opened. */
+#define LM77_NODE_CHANGES 3
+
+/* Bus trace ring, shared by all clients; a power of two. Every line of
+   the proc file is LM77_TRACE_LINE bytes, so an offset maps to an entry
+   without walking the ring. */
+#define LM77_TRACE 512
+#define LM77_TRACE_LINE 45
+
+/* Events kept per client, a power of two */
+#define LM77_EVENTS 64
+
+/* Running statistics. The windows of temp_win1/5/15 are made up of
+   LM77_BUCKET_SECS buckets, so they are exact to that granularity. */
+#define LM77_BUCKET_SECS 15
+#define LM77_BUCKETS (15 * 60 / LM77_BUCKET_SECS)
+#define LM77_EWMA_SHIFT 8		/* Fixed point of the averages */
+#define LM77_EWMA_ONE 1024		/* Fixed point of the weights */
+
+/* Change log geometry. A block must hold a keyframe plus the largest
+   pair of records (2 * (1 + 5)). */
+#define LM77_CHANGE_BLOCK 256
+#define LM77_CHANGE_MAX_BLOCKS 256
+#define LM77_CHANGE_REC 12
+
+
+#ifdef LM77_STATS
+#define LM77_STATS_BUCKETS 32
+
+struct lm77_stats {
+	unsigned long reads;		/* Registers read */
+	unsigned long writes;		/* Registers written */
+	unsigned long errors;		/* Failed transfers */
+	unsigned long hits;		/* Reads served from the cache */
+	unsigned long misses;		/* Reads that caused a refresh */
+	unsigned long waits;		/* Stale, but no conversion since */
+	unsigned long repeats;		/* Refreshes without a new value */
+	unsigned long contended;	/* update_lock was taken already */
+	unsigned long retries;		/* Snapshot reads that raced a writer */
+	cycles_t lock_wait;		/* Spent waiting for update_lock */
+	unsigned long latency[LM77_STATS_BUCKETS];	/* log2(cycles) */
+} ____cacheline_aligned;		/* One per CPU, see lm77_stats() */
+#endif
+
+/* One register transfer in the bus trace */
+struct lm77_trace {
+	unsigned long jiffies;		/* When it finished */
+	unsigned long cycles;		/* How long it took */
+	u8 bus, addr, reg;
+	char op;			/* 'r', 'w', or 'b' in a batch read */
+	int value;			/* Read or written, or the error */
+};
+
+/* Statistics of the readings in one LM77_BUCKET_SECS period */
+struct lm77_bucket {
+	unsigned long epoch;		/* jiffies / bucket length */
+	int min, max;
+	long sum;
+	int count;
+};
+
+#define LM77_NUM_REGS 6
+
+/* A consistent set of readings, as handed out to readers. They are kept
+   as raw registers and only converted by whoever needs the value. */
+struct lm77_sample {
+	char valid;
+	unsigned long last_updated;	/* In jiffies */
+
+	u16 reg[LM77_NUM_REGS];		/* Indexed by register number */
+	u8 alarms;			/* After debouncing */
+	long interval;			/* cur_interval, for lm77_expired() */
+	long avg[3];			/* temp_avg, in tenths */
+	unsigned long conv;		/* Latest possible conversion time of
+					   the reading, in jiffies */
+};
 
-/* Each client has this additional data */
+/* Each client has this additional data. The lock-free readers of
+   lm77_get_sample() only load pub and pub_seq, so those get a cache line
+   of their own (kmalloc hands out cache aligned memory); the writer side
+   can take update_lock and refresh without taking that line away from
+   every CPU that is polling. */
 struct lm77_data {
 	struct i2c_client client;
 	int sysctl_id;
+	struct list_head list;		/* In lm77_clients */
+	int slot;			/* Index into lm77_slots, or -1 */
+	int kind;			/* Into lm77_chips */
+	int users;			/* Open devices and mappings */
+	char dead;			/* Detached, freed on last close */
 
 	struct semaphore update_lock;
+	char i2c_xfer;			/* Use i2c_transfer() for registers */
+	int pointer;			/* Pointer register, -1 if unknown */
+	u8 conf;			/* Last value written to LM77_REG_CONF */
+	char duty;			/* Shut down between samples */
 	char valid;
 	unsigned long last_updated;	/* In jiffies */
+	unsigned long last_try;		/* Last refresh, failed or not */
+	unsigned long limits_updated;	/* In jiffies */
+	unsigned long stale_since[LM77_NUM_REGS]; /* 0 if fresh */
+	int errors;			/* Failed refreshes in a row */
+	long interval;			/* Cache lifetime, in jiffies */
+	long cur_interval;		/* Same, after adaptation */
+	char adaptive;
+	char warm;			/* Attached through the warm list */
+	int guard;			/* Guard band in tenths, 0 if off */
+	u16 guard_low, guard_high;	/* As written, 0xffff if unknown */
+	u8 guard_restore;		/* Bit per real limit not yet back */
+	unsigned long due;		/* Next refresh by the sampler */
+	char scheduled;			/* due is set, see lm77_stagger() */
+
+	/* Conversion cadence, see lm77_conv_seen() */
+	unsigned long conv_edge;	/* A conversion was done by then */
+	long conv_period;		/* << LM77_CONV_SHIFT */
+	char conv_known;		/* conv_edge is set */
+
+	/* Shadow of the temperature registers (TEMP including its alarm
+	   bits), see lm77_set_reg(). dirty has a bit for every register that
+	   changed since the last lm77_publish(). */
+	u16 reg[LM77_NUM_REGS];
+	u8 dirty;
+	u8 alarms;			/* Alarm bits, after debouncing */
+	u8 alarm_pending;		/* Alarm bits waiting to be confirmed */
+	int alarm_count;		/* Refreshes alarm_pending was seen */
+	int debounce;			/* Refreshes needed to confirm */
+
+	/* Published copy of the above, for readers. It is protected by the
+	   sequence counter pub_seq: odd while lm77_publish() is writing.
+	   Everything else in here belongs to whoever holds update_lock. */
+	struct lm77_sample pub ____cacheline_aligned;
+	unsigned int pub_seq;
+
+	/* Bumped and woken up whenever the published alarms change */
+	unsigned int alarm_gen ____cacheline_aligned;
+	wait_queue_head_t alarm_wait;
+
+	/* Event ring; event n is in events[n % LM77_EVENTS]. Written under
+	   update_lock, readers only take event_lock. */
+	struct lm77_event events[LM77_EVENTS] ____cacheline_aligned;
+	unsigned int event_head;	/* Events ever queued */
+	int event_temp;			/* Temperature of the last TEMP event */
+	spinlock_t event_lock;
+	wait_queue_head_t event_wait;
+	struct fasync_struct *event_fasync;
+
+	int irq;			/* 0 if INT is not wired */
+	struct tq_struct irq_task;
+
+#ifdef LM77_STATS
+	struct lm77_stats stats[NR_CPUS];
+#endif
+
+	struct lm77_history *history;	/* NULL if history_size is 0 */
+	int history_order;		/* Of the pages backing it */
+
+	/* Running statistics, see lm77_trend_add() */
+	long ewma[3];			/* << LM77_EWMA_SHIFT */
+	unsigned long ewma_time;
+	struct lm77_bucket bucket[LM77_BUCKETS];
+
+	u8 *changes;			/* NULL if change_log is 0 */
+	int change_blocks;
+	unsigned int change_head;	/* Blocks ever started */
+	int change_off;			/* Into the current block */
+	unsigned long change_time;	/* Of the last record */
+	int change_temp;		/* In register steps */
+	u8 change_alarms;
+};
+
+struct lm77_file {
+	struct lm77_data *data;
+	int node;
+	unsigned int alarm_gen;		/* Last generation returned */
+	unsigned int event_pos;		/* Next event to return */
+	char *buf;			/* Copy of the change log */
+	size_t len;
+};
+
+static inline const struct lm77_chip *lm77_chip(struct lm77_data *data)
+{
+#if LM77_KINDS == 1
+	return &lm77_chips[lm77];
+#else
+	return &lm77_chips[data->kind];
+#endif
+}
+
+/* Size of a register in bytes */
+static inline int lm77_reg_len(struct lm77_data *data, u8 reg)
+{
+	return (lm77_chip(data)->byte_regs & (1 << reg)) ? 1 : 2;
+}
+
+/* Register shadow. Temperatures are converted when they are used, in
+   tenths of a degree on the writer side. */
+static inline void lm77_set_reg(struct lm77_data *data, u8 reg, u16 val)
+{
+	if (data->reg[reg] != val) {
+		data->reg[reg] = val;
+		data->dirty |= 1 << reg;
+	}
+}
+
+static inline int lm77_temp(struct lm77_data *data, u8 reg)
+{
+	return lm77_chip(data)->from_reg(data->reg[reg]);
+}
+
+/* Does the chip hold a guard band instead of this limit? The shadow
+   keeps the real one then. That is also the case after guard band mode
+   was turned off, until the real limit could be written back. */
+static inline int lm77_guarded(struct lm77_data *data, u8 reg)
+{
+	return (data->guard &&
+	        (reg == LM77_REG_T_LOW || reg == LM77_REG_T_HIGH)) ||
+	       (data->guard_restore & (1 << reg));
+}
+
+/* Conversions for the sysctl files and the sensors proc file, which
+   follow the millidegree parameter */
+static inline int lm77_mag(void)
+{
+	return millidegree ? 0 : 1;
+}
+
+static inline long lm77_out(struct lm77_data *data,
+			    const struct lm77_sample *s, u8 reg)
+{
+	return millidegree ? lm77_chip(data)->from_reg_mc(s->reg[reg])
+	                   : lm77_chip(data)->from_reg(s->reg[reg]);
+}
+
+/* Values derived from tenths of a degree, like the averages */
+static inline long lm77_out_tenths(long temp)
+{
+	return millidegree ? temp * 100 : temp;
+}
+
+/* A written value, back to tenths of a degree */
+static inline long lm77_in(long temp)
+{
+	return millidegree ? temp / 100 : temp;
+}
+
+/* A written value, as register contents. Millidegrees are converted at
+   register resolution directly, not by way of tenths. */
+static inline u16 lm77_in_reg(struct lm77_data *data, long temp)
+{
+	return millidegree ? lm77_chip(data)->to_reg_mc(temp)
+	                   : lm77_chip(data)->to_reg(temp);
+}
+
+/* Performance counters. Every CPU counts into its own copy, so neither
+   the lock-free read path nor the writer share a cache line for them,
+   and no increment is lost. Readers add the copies up with
+   lm77_stat_sum(). */
+#ifdef LM77_STATS
+static inline struct lm77_stats *lm77_stats(struct lm77_data *data)
+{
+	return &data->stats[smp_processor_id()];
+}
 
-	int temp_input;			/* Current temperature */
-	int temp_crit; 			/* Critical temperature bound */
-	int temp_min;			/* Minimum temperature bound */
-	int temp_max;			/* Maximum temperature bound */
-	int temp_hyst;			/* Hysteresis (relative) */
-	u8 alarms;			/* Alarm bits */
+static void lm77_stat_sum(struct lm77_data *data, struct lm77_stats *st)
+{
+	struct lm77_stats *c;
+	int cpu, i;
+
+	memset(st, 0, sizeof(*st));
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		c = &data->stats[cpu];
+		st->reads += c->reads;
+		st->writes += c->writes;
+		st->errors += c->errors;
+		st->hits += c->hits;
+		st->misses += c->misses;
+		st->waits += c->waits;
+		st->repeats += c->repeats;
+		st->contended += c->contended;
+		st->retries += c->retries;
+		st->lock_wait += c->lock_wait;
+		for (i = 0; i < LM77_STATS_BUCKETS; i++)
+			st->latency[i] += c->latency[i];
+	}
+}
+
+static inline cycles_t lm77_stat_now(void)
+{
+	return get_cycles();
+}
+
+static void lm77_stat_bus(struct lm77_data *data, int write, int n,
+			  cycles_t start, int ret)
+{
+	struct lm77_stats *st = lm77_stats(data);
+	cycles_t delta = get_cycles() - start;
+	int bucket = 0;
+
+	while ((delta >>= 1) && bucket < LM77_STATS_BUCKETS - 1)
+		bucket++;
+	st->latency[bucket]++;
+
+	if (write)
+		st->writes += n;
+	else
+		st->reads += n;
+	if (ret < 0)
+		st->errors++;
+}
+
+#define LM77_STAT_INC(data, field)	(lm77_stats(data)->field++)
+#else
+static inline cycles_t lm77_stat_now(void)
+{
+	return trace ? get_cycles() : 0;
+}
+
+static inline void lm77_stat_bus(struct lm77_data *data, int write, int n,
+				 cycles_t start, int ret)
+{
+}
+
+#define LM77_STAT_INC(data, field)	do { } while (0)
+#endif
+
+static inline void lm77_lock(struct lm77_data *data)
+{
+#ifdef LM77_STATS
+	cycles_t start = get_cycles();
+
+	if (!down_trylock(&data->update_lock))
+		return;
+	lm77_stats(data)->contended++;
+	down(&data->update_lock);
+	lm77_stats(data)->lock_wait += get_cycles() - start;
+#else
+	down(&data->update_lock);
+#endif
+}
+
+static inline void lm77_unlock(struct lm77_data *data)
+{
+	up(&data->update_lock);
+}
+
+/* Take the update lock for a write that goes to the chip. Fails once
+   lm77_detach_client() has started, so that nothing reprograms a chip
+   that is being handed back. */
+static inline int lm77_lock_live(struct lm77_data *data)
+{
+	lm77_lock(data);
+	if (data->dead) {
+		lm77_unlock(data);
+		return 0;
+	}
+	return 1;
+}
+
+/* All attached clients, walked by the sampler thread. The lock also
+   protects lm77_slots and the users field of every client; dead is set
+   with both this lock and the update lock held, so either is enough to
+   read it. */
+static LIST_HEAD(lm77_clients);
+static DECLARE_MUTEX(lm77_clients_lock);
+static struct lm77_data *lm77_slots[LM77_MAX_CLIENTS];
+
+static int lm77_sampler_pid = 0;
+static int lm77_sampler_stop = 0;
+static DECLARE_WAIT_QUEUE_HEAD(lm77_sampler_wait);
+static DECLARE_COMPLETION(lm77_sampler_exit);
+
+/* Addresses where detection failed, see negative_cache */
+struct lm77_neg {
+	int id;				/* i2c_adapter_id(), -1 if unused */
+	char name[32];			/* Adapter name at the time */
+	unsigned short addr;
+};
+
+static struct lm77_neg lm77_neg_cache[LM77_NEG_CACHE] = {
+	[0 ... LM77_NEG_CACHE - 1] = { .id = -1 }
+};
+static int lm77_neg_next = 0;
+static DECLARE_MUTEX(lm77_neg_lock);
+
+/* Adapters waiting for the async_probe thread. A pinned module does not
+   keep an adapter from being deleted, so each queued adapter also gets a
+   placeholder client at the general call address: i2c_del_adapter()
+   detaches it through lm77_probe_cancel(), which drops the entry. */
+struct lm77_probe {
+	struct list_head list;
+	struct i2c_adapter *adapter;
+	struct module *owner;		/* Of the adapter, pinned */
+	struct i2c_client client;	/* Placeholder */
+	int gone;			/* Placeholder detached */
 };
 
+#define LM77_PROBE_ADDR 0x00
+
+static LIST_HEAD(lm77_probe_queue);
+static DECLARE_MUTEX(lm77_probe_lock);
+static struct lm77_probe *lm77_probe_cur;	/* Being probed */
+static int lm77_prober_pid = 0;
+static int lm77_prober_stop = 0;
+static DECLARE_WAIT_QUEUE_HEAD(lm77_prober_wait);
+static DECLARE_COMPLETION(lm77_prober_exit);
+
+/* /proc/driver/lm77, for module wide views */
+static struct proc_dir_entry *lm77_proc_dir;
+
+static struct lm77_trace lm77_trace_ring[LM77_TRACE];
+static unsigned int lm77_trace_head = 0;	/* Entries ever added */
+static spinlock_t lm77_trace_lock = SPIN_LOCK_UNLOCKED;
+
 static int lm77_attach_adapter(struct i2c_adapter *adapter);
 static int lm77_detect(struct i2c_adapter *adapter, int address,
 		       unsigned short flags, int kind);
 static void lm77_init_client(struct i2c_client *client);
 static int lm77_detach_client(struct i2c_client *client);
+static int lm77_probe_cancel(struct i2c_client *client);
+static void lm77_quiesce(struct i2c_client *client);
+static void lm77_interrupt(int irq, void *dev_id, struct pt_regs *regs);
+static void lm77_irq_work(void *arg);
+static void lm77_history_alloc(struct lm77_data *data);
+static void lm77_change_alloc(struct lm77_data *data);
 
 static int lm77_read_value(struct i2c_client *client, u8 reg);
 static int lm77_write_value(struct i2c_client *client, u8 reg, u16 value);
+static void lm77_read_block(struct i2c_client *client, const u8 *regs,
+			    int n, int *vals);
+static int lm77_write_conf(struct i2c_client *client, u8 conf);
 static void lm77_update_client(struct i2c_client *client);
+static void lm77_update_limits(struct i2c_client *client);
+static inline void lm77_mark(struct lm77_data *data, u8 reg, int ok);
+static void lm77_refresh(struct i2c_client *client);
+static void lm77_adapt_interval(struct lm77_data *data, int old_temp);
+static void lm77_conv_seen(struct lm77_data *data, unsigned long now,
+                           int changed);
+static unsigned long lm77_next_conv(struct lm77_data *data, unsigned long t);
+static void lm77_trend_add(struct lm77_data *data);
+static void lm77_debounce(struct lm77_data *data, u8 alarms);
+static void lm77_seed(struct i2c_client *client, int temp);
+static void lm77_guard_set(struct i2c_client *client, int guard);
+static void lm77_guard_center(struct i2c_client *client);
+static void lm77_guard_restore(struct i2c_client *client);
+static void lm77_publish(struct lm77_data *data);
+static void lm77_get_sample(struct i2c_client *client, struct lm77_sample *s);
+static void lm77_read_snapshot(struct lm77_data *data, struct lm77_sample *s);
+static void lm77_history_add(struct lm77_data *data, int temp);
+static void lm77_change_add(struct lm77_data *data, int temp);
+static void lm77_event_add(struct lm77_data *data, int type, u8 changed);
+static void lm77_free_data(struct lm77_data *data);
+static void lm77_put(struct lm77_data *data);
+static void lm77_daemonize(const char *name);
 
 static void lm77_proc_temp(struct i2c_client *client, int operation,
 		      int ctl_name, int *nrels_mag, long *results);
 static void lm77_proc_alarms(struct i2c_client *client, int operation,
 		      int ctl_name, int *nrels_mag, long *results);
+static void lm77_proc_interval(struct i2c_client *client, int operation,
+		      int ctl_name, int *nrels_mag, long *results);
+static void lm77_proc_duty(struct i2c_client *client, int operation,
+		      int ctl_name, int *nrels_mag, long *results);
+static void lm77_proc_filter(struct i2c_client *client, int operation,
+		      int ctl_name, int *nrels_mag, long *results);
+static void lm77_proc_guard(struct i2c_client *client, int operation,
+		      int ctl_name, int *nrels_mag, long *results);
+static void lm77_proc_trend(struct i2c_client *client, int operation,
+		      int ctl_name, int *nrels_mag, long *results);
+static void lm77_proc_age(struct i2c_client *client, int operation,
+			  int ctl_name, int *nrels_mag, long *results);
+static void lm77_proc_status(struct i2c_client *client, int operation,
+		      int ctl_name, int *nrels_mag, long *results);
+static void lm77_proc_slot(struct i2c_client *client, int operation,
+		      int ctl_name, int *nrels_mag, long *results);
+#ifdef LM77_STATS
+static void lm77_proc_stats_reset(struct i2c_client *client, int operation,
+		      int ctl_name, int *nrels_mag, long *results);
+#endif
 #ifdef DEBUG
 static void lm77_proc_reset(struct i2c_client *client, int operation,
 		      int ctl_name, int *nrels_mag, long *results);
@@ -138,6 +920,12 @@ static struct i2c_driver lm77_driver = {
 	.detach_client	= lm77_detach_client,
 };
 
+/* Owner of the placeholder clients of queued probes, never registered */
+static struct i2c_driver lm77_probe_driver = {
+	.name		= "LM77 probe placeholder",
+	.detach_client	= lm77_probe_cancel,
+};
+
 /* -- SENSORS SYSCTL START -- */
 
 #define LM77_SYSCTL_TEMP 1200 		/* Temperature readings */
@@ -147,6 +935,21 @@ static struct i2c_driver lm77_driver = {
 #ifdef DEBUG
 #define LM77_SYSCTL_RESET 1204		/* LM77 reset */
 #endif
+#define LM77_SYSCTL_UPDATE_INTERVAL 1205	/* Cache lifetime */
+#ifdef LM77_STATS
+#define LM77_SYSCTL_STATS_RESET 1206	/* Clear performance counters */
+#endif
+#define LM77_SYSCTL_DUTY_CYCLE 1207	/* Shut down between samples */
+#define LM77_SYSCTL_ALARM_FILTER 1208	/* Fault queue and debouncing */
+#define LM77_SYSCTL_TEMP_AVG 1209	/* Moving averages */
+#define LM77_SYSCTL_TEMP_WIN1 1210	/* Min, max, mean over 1 minute */
+#define LM77_SYSCTL_TEMP_WIN5 1211	/* Same over 5 minutes */
+#define LM77_SYSCTL_TEMP_WIN15 1212	/* Same over 15 minutes */
+#define LM77_SYSCTL_TEMP_SLOPE 1213	/* Trend, per minute */
+#define LM77_SYSCTL_STATUS 1214		/* Bus errors and stale readings */
+#define LM77_SYSCTL_TEMP_AGE 1215	/* Age of the current reading */
+#define LM77_SYSCTL_GUARD_BAND 1216	/* Change detection through INT */
+#define LM77_SYSCTL_SLOT 1217		/* Character device slot */
 
 /* -- SENSORS SYSCTL END -- */
 
@@ -164,6 +967,34 @@ static ctl_table lm77_dir_table_template[] = {
 	 &i2c_sysctl_real, NULL, &lm77_proc_temp},
 	{LM77_SYSCTL_ALARMS, "alarms", NULL, 0, 0444, NULL, &i2c_proc_real,
 	 &i2c_sysctl_real, NULL, &lm77_proc_alarms},
+	{LM77_SYSCTL_TEMP_AVG, "temp_avg", NULL, 0, 0444, NULL, &i2c_proc_real,
+	 &i2c_sysctl_real, NULL, &lm77_proc_trend},
+	{LM77_SYSCTL_TEMP_WIN1, "temp_win1", NULL, 0, 0444, NULL,
+	 &i2c_proc_real, &i2c_sysctl_real, NULL, &lm77_proc_trend},
+	{LM77_SYSCTL_TEMP_WIN5, "temp_win5", NULL, 0, 0444, NULL,
+	 &i2c_proc_real, &i2c_sysctl_real, NULL, &lm77_proc_trend},
+	{LM77_SYSCTL_TEMP_WIN15, "temp_win15", NULL, 0, 0444, NULL,
+	 &i2c_proc_real, &i2c_sysctl_real, NULL, &lm77_proc_trend},
+	{LM77_SYSCTL_TEMP_SLOPE, "temp_slope", NULL, 0, 0444, NULL,
+	 &i2c_proc_real, &i2c_sysctl_real, NULL, &lm77_proc_trend},
+	{LM77_SYSCTL_STATUS, "status", NULL, 0, 0444, NULL, &i2c_proc_real,
+	 &i2c_sysctl_real, NULL, &lm77_proc_status},
+	{LM77_SYSCTL_TEMP_AGE, "temp_age", NULL, 0, 0444, NULL, &i2c_proc_real,
+	 &i2c_sysctl_real, NULL, &lm77_proc_age},
+	{LM77_SYSCTL_UPDATE_INTERVAL, "update_interval", NULL, 0, 0644, NULL,
+	 &i2c_proc_real, &i2c_sysctl_real, NULL, &lm77_proc_interval},
+	{LM77_SYSCTL_DUTY_CYCLE, "duty_cycle", NULL, 0, 0644, NULL,
+	 &i2c_proc_real, &i2c_sysctl_real, NULL, &lm77_proc_duty},
+	{LM77_SYSCTL_ALARM_FILTER, "alarm_filter", NULL, 0, 0644, NULL,
+	 &i2c_proc_real, &i2c_sysctl_real, NULL, &lm77_proc_filter},
+	{LM77_SYSCTL_GUARD_BAND, "guard_band", NULL, 0, 0644, NULL,
+	 &i2c_proc_real, &i2c_sysctl_real, NULL, &lm77_proc_guard},
+	{LM77_SYSCTL_SLOT, "slot", NULL, 0, 0444, NULL, &i2c_proc_real,
+	 &i2c_sysctl_real, NULL, &lm77_proc_slot},
+#ifdef LM77_STATS
+	{LM77_SYSCTL_STATS_RESET, "stats_reset", NULL, 0, 0644, NULL,
+	 &i2c_proc_real, &i2c_sysctl_real, NULL, &lm77_proc_stats_reset},
+#endif
 #ifdef DEBUG
 	{LM77_SYSCTL_RESET, "reset", NULL, 0, 0644, NULL, &i2c_proc_real,
 	 &i2c_sysctl_real, NULL, &lm77_proc_reset},
@@ -173,9 +1004,246 @@ static ctl_table lm77_dir_table_template[] = {
 
 
 
+/* Is adapter/address in a list of bus,address pairs as used by the
+   SENSORS_MODULE_PARM style insmod parameters? */
+static int lm77_in_list(unsigned short *list, struct i2c_adapter *adapter,
+			int address)
+{
+	int i, bus = i2c_adapter_id(adapter);
+
+	for (i = 0; i + 1 < SENSORS_MAX_OPTS && list[i] != SENSORS_I2C_END;
+	     i += 2)
+		if ((list[i] == SENSORS_ANY_I2C_BUS || list[i] == bus)
+		    && list[i + 1] == address)
+			return 1;
+	return 0;
+}
+
+/* Is the adapter in an adapters/skip_adapters style list? */
+static int lm77_adapter_listed(const char *list, struct i2c_adapter *adapter)
+{
+	const char *end;
+	char word[32], *e;
+	int len;
+
+	while (*list) {
+		if (!(end = strchr(list, ',')))
+			end = list + strlen(list);
+		len = end - list;
+
+		if (len > 0 && len < sizeof(word)) {
+			memcpy(word, list, len);
+			word[len] = '\0';
+			if (simple_strtoul(word, &e, 10) ==
+			    i2c_adapter_id(adapter) && !*e)
+				return 1;
+			if (*e && strstr(adapter->name, word))
+				return 1;
+		}
+
+		list = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+/* Should the adapter be probed at all? */
+static int lm77_adapter_wanted(struct i2c_adapter *adapter)
+{
+	if (adapters && *adapters && !lm77_adapter_listed(adapters, adapter))
+		return 0;
+	if (skip_adapters && lm77_adapter_listed(skip_adapters, adapter))
+		return 0;
+	return 1;
+}
+
+static struct lm77_neg *lm77_neg_find(struct i2c_adapter *adapter,
+				      int address)
+{
+	int i, id = i2c_adapter_id(adapter);
+
+	for (i = 0; i < LM77_NEG_CACHE; i++)
+		if (lm77_neg_cache[i].id == id &&
+		    lm77_neg_cache[i].addr == address &&
+		    !strncmp(lm77_neg_cache[i].name, adapter->name,
+		             sizeof(lm77_neg_cache[i].name)))
+			return &lm77_neg_cache[i];
+	return NULL;
+}
+
+static int lm77_neg_test(struct i2c_adapter *adapter, int address)
+{
+	int found;
+
+	if (!negative_cache)
+		return 0;
+
+	down(&lm77_neg_lock);
+	found = lm77_neg_find(adapter, address) != NULL;
+	up(&lm77_neg_lock);
+	return found;
+}
+
+static void lm77_neg_add(struct i2c_adapter *adapter, int address)
+{
+	struct lm77_neg *n;
+
+	if (!negative_cache)
+		return;
+
+	down(&lm77_neg_lock);
+	if (!lm77_neg_find(adapter, address)) {
+		n = &lm77_neg_cache[lm77_neg_next];
+		lm77_neg_next = (lm77_neg_next + 1) % LM77_NEG_CACHE;
+		n->id = i2c_adapter_id(adapter);
+		strncpy(n->name, adapter->name, sizeof(n->name));
+		n->addr = address;
+	}
+	up(&lm77_neg_lock);
+}
+
+/* With async_probe the adapter is only queued. The module of the bus
+   driver is pinned until the probe is done, and the placeholder client
+   tells us if the adapter is deleted before that. Whatever cannot be
+   queued is probed right away. */
 static int lm77_attach_adapter(struct i2c_adapter *adapter)
 {
-	return i2c_detect(adapter, &addr_data, lm77_detect);
+	struct lm77_probe *p;
+
+	if (!lm77_adapter_wanted(adapter))
+		return 0;
+
+	if (!lm77_prober_pid ||
+	    !(p = kmalloc(sizeof(struct lm77_probe), GFP_KERNEL)))
+		return i2c_detect(adapter, &addr_data, lm77_detect);
+
+	memset(p, 0, sizeof(struct lm77_probe));
+	p->adapter = adapter;
+	p->owner = adapter->owner;
+	p->client.addr = LM77_PROBE_ADDR;
+	p->client.adapter = adapter;
+	p->client.driver = &lm77_probe_driver;
+	p->client.data = p;
+	strcpy(p->client.name, "LM77 probe pending");
+
+	if (!try_inc_mod_count(p->owner)) {
+		kfree(p);
+		return 0;		/* the bus driver is going away */
+	}
+	if (i2c_attach_client(&p->client)) {
+		if (p->owner)
+			__MOD_DEC_USE_COUNT(p->owner);
+		kfree(p);
+		return i2c_detect(adapter, &addr_data, lm77_detect);
+	}
+
+	down(&lm77_probe_lock);
+	list_add_tail(&p->list, &lm77_probe_queue);
+	up(&lm77_probe_lock);
+
+	wake_up_interruptible(&lm77_prober_wait);
+	return 0;
+}
+
+static struct lm77_probe *lm77_probe_next(void)
+{
+	struct lm77_probe *p = NULL;
+
+	down(&lm77_probe_lock);
+	if (!list_empty(&lm77_probe_queue)) {
+		p = list_entry(lm77_probe_queue.next, struct lm77_probe, list);
+		list_del(&p->list);
+		lm77_probe_cur = p;
+	}
+	up(&lm77_probe_lock);
+	return p;
+}
+
+static void lm77_probe_free(struct lm77_probe *p)
+{
+	if (p->owner)
+		__MOD_DEC_USE_COUNT(p->owner);
+	kfree(p);
+}
+
+/* Called by i2c_del_adapter() for the placeholder of a queued adapter.
+   A queued entry is dropped. The one being probed is only marked, the
+   prober frees it when i2c_detect() returns. */
+static int lm77_probe_cancel(struct i2c_client *client)
+{
+	struct lm77_probe *p = client->data;
+	int queued;
+
+	down(&lm77_probe_lock);
+	if (p->gone) {
+		/* the prober is detaching it already */
+		up(&lm77_probe_lock);
+		return 0;
+	}
+	p->gone = 1;
+	if ((queued = p != lm77_probe_cur))
+		list_del(&p->list);
+	up(&lm77_probe_lock);
+
+	i2c_detach_client(client);
+	if (queued)
+		lm77_probe_free(p);
+	return 0;
+}
+
+/* Done with p, whether it was probed or not */
+static void lm77_probe_done(struct lm77_probe *p)
+{
+	int gone;
+
+	down(&lm77_probe_lock);
+	gone = p->gone;
+	p->gone = 1;
+	up(&lm77_probe_lock);
+
+	if (!gone)
+		i2c_detach_client(&p->client);
+
+	down(&lm77_probe_lock);
+	if (lm77_probe_cur == p)
+		lm77_probe_cur = NULL;
+	up(&lm77_probe_lock);
+	lm77_probe_free(p);
+}
+
+/* Probe queued adapters one at a time. Once told to stop, whatever is
+   still queued is dropped without probing. */
+static int lm77_prober(void *unused)
+{
+	struct lm77_probe *p;
+
+	lm77_daemonize("klm77probe");
+
+	for (;;) {
+		wait_event_interruptible(lm77_prober_wait,
+		                         !list_empty(&lm77_probe_queue) ||
+		                         lm77_prober_stop);
+		if (!(p = lm77_probe_next())) {
+			if (lm77_prober_stop)
+				break;
+			continue;
+		}
+
+		if (!lm77_prober_stop && !p->gone)
+			i2c_detect(p->adapter, &addr_data, lm77_detect);
+		lm77_probe_done(p);
+	}
+
+	complete_and_exit(&lm77_prober_exit, 0);
+}
+
+static void lm77_stop_prober(void)
+{
+	if (lm77_prober_pid > 0) {
+		lm77_prober_stop = 1;
+		wake_up_interruptible(&lm77_prober_wait);
+		wait_for_completion(&lm77_prober_exit);
+		lm77_prober_pid = 0;
+	}
 }
 
 /* This function is called by i2c_detect */
@@ -185,7 +1253,7 @@ int lm77_detect(struct i2c_adapter *adapter, int address,
 	int i;
 	struct i2c_client *new_client;
 	struct lm77_data *data;
-	int err = 0;
+	int err = 0, is_warm = 0;
 	const char *type_name, *client_name;
 
 	/* Make sure we aren't probing the ISA bus!! This is just a safety check
@@ -202,6 +1270,17 @@ int lm77_detect(struct i2c_adapter *adapter, int address,
 				     I2C_FUNC_SMBUS_WORD_DATA))
 		    goto error0;
 
+	if (kind < 0 && lm77_in_list(warm, adapter, address)) {
+		kind = lm77;
+		is_warm = 1;
+	}
+
+	if (kind < 0 && lm77_neg_test(adapter, address)) {
+		pr_debug("lm77.o: skipping bus %d, io %x (failed before)\n",
+		         i2c_adapter_id(adapter), address);
+		goto error0;
+	}
+
 	/* OK. For now, we presume we have a valid client. We now create the
 	   client structure, even though we cannot fill it completely yet.
 	   But it allows us to access lm75_{read,write}_value. */
@@ -210,6 +1289,7 @@ int lm77_detect(struct i2c_adapter *adapter, int address,
 		goto error0;
 	}
 	memset(data, 0, sizeof(struct lm77_data));
+	data->warm = is_warm;
 
 	new_client = &data->client;
 	new_client->addr = address;
@@ -228,9 +1308,22 @@ int lm77_detect(struct i2c_adapter *adapter, int address,
 	   3. addresses 0x06 and 0x07 return the last read value
 	   4. registers cycling over 8-address boundaries
 	   
-	   Word-sized registers are high-byte first. */
+	   Word-sized registers are high-byte first.
+
+	   The cheap checks 1 and 2 work on the values we need anyway and are
+	   done first, so that most other chips are rejected after six reads.
+	   Check 4 costs five reads per mirror. In strict mode (detect_mode 0)
+	   all 31 mirrors are checked, 155 reads in total. In fast mode only the
+	   first detect_blocks entries of lm77_mirror_order are checked. With
+	   the default of 6, each of the address bits 3 to 7 is toggled on its
+	   own once and all of them together once. Any chip that decodes one of
+	   these bits is therefore still rejected. Fast mode accepts chips
+	   that ignore the upper address bits completely, but also match checks
+	   1 to 3. Strict mode would only catch those if the pattern broke in
+	   a mirror that was not sampled. For addresses listed in the known
+	   parameter, check 4 is skipped altogether. */
 	if (kind < 0) {
-		int i, cur, conf, hyst, crit, min, max;
+		int i, n, cur, conf, hyst, crit, min, max;
 
 		/* Unused addresses */
 		cur = i2c_smbus_read_word_data(new_client, 0);
@@ -239,14 +1332,6 @@ int lm77_detect(struct i2c_adapter *adapter, int address,
 		crit = i2c_smbus_read_word_data(new_client, 3);
 		min = i2c_smbus_read_word_data(new_client, 4);
 		max = i2c_smbus_read_word_data(new_client, 5);
-		for (i = 8; i <= 0xff; i += 8)
-			if (i2c_smbus_read_byte_data(new_client, i + 1) != conf
-			    || i2c_smbus_read_word_data(new_client, i + 2) != hyst
-			    || i2c_smbus_read_word_data(new_client, i + 3) != crit
-			    || i2c_smbus_read_word_data(new_client, i + 4) != min
-			    || i2c_smbus_read_word_data(new_client, i + 5) != max)
-				goto error1;
-
 
 		/* sign bits */
 		if (((cur & 0x00f0) != 0xf0 && (cur & 0x00f0) != 0x0)
@@ -265,23 +1350,43 @@ int lm77_detect(struct i2c_adapter *adapter, int address,
 		if (i2c_smbus_read_word_data(new_client, 6) != cur
 		    || i2c_smbus_read_word_data(new_client, 7) != cur)
 			goto error1;
-		hyst = i2c_smbus_read_word_data(new_client, 0);
-		if (i2c_smbus_read_word_data(new_client, 6) != hyst
-		    || i2c_smbus_read_word_data(new_client, 7) != hyst)
+		cur = i2c_smbus_read_word_data(new_client, 0);
+		if (i2c_smbus_read_word_data(new_client, 6) != cur
+		    || i2c_smbus_read_word_data(new_client, 7) != cur)
 			goto error1;
-		hyst = i2c_smbus_read_word_data(new_client, 0);
-		if (i2c_smbus_read_word_data(new_client, 6) != hyst
-		    || i2c_smbus_read_word_data(new_client, 7) != hyst)
+		cur = i2c_smbus_read_word_data(new_client, 0);
+		if (i2c_smbus_read_word_data(new_client, 6) != cur
+		    || i2c_smbus_read_word_data(new_client, 7) != cur)
 			goto error1;
+
+		/* register mirrors, bail out on the first mismatch */
+		if (lm77_in_list(known, adapter, address))
+			n = 0;
+		else if (detect_mode == 0)
+			n = 31;
+		else
+			n = SENSORS_LIMIT(detect_blocks, 1, 31);
+
+		for (i = 0; i < n; i++) {
+			int base = lm77_mirror_order[i];
+
+			if (i2c_smbus_read_byte_data(new_client, base + 1) != conf
+			    || i2c_smbus_read_word_data(new_client, base + 2) != hyst
+			    || i2c_smbus_read_word_data(new_client, base + 3) != crit
+			    || i2c_smbus_read_word_data(new_client, base + 4) != min
+			    || i2c_smbus_read_word_data(new_client, base + 5) != max)
+				goto error1;
+		}
 	}
 
-	/* Determine the chip type - only one kind supported! */
+	/* Determine the chip type - only one kind is detected */
 	if (kind <= 0)
 		kind = lm77;
 
-	if (kind == lm77) {
-		type_name = "lm77";
-		client_name = "LM77 chip";
+	if (kind <= LM77_KINDS && lm77_chips[kind].type_name) {
+		type_name = lm77_chips[kind].type_name;
+		client_name = lm77_chips[kind].client_name;
+		data->kind = kind;
 	} else {
 		pr_debug("lm77.o: Internal error: unknown kind (%d)?!?", kind);
 		goto error1;
@@ -291,11 +1396,55 @@ int lm77_detect(struct i2c_adapter *adapter, int address,
 	strcpy(new_client->name, client_name);
 	data->valid = 0;
 	init_MUTEX(&data->update_lock);
+	data->i2c_xfer = !smbus_only &&
+	                 i2c_check_functionality(adapter, I2C_FUNC_I2C);
+	data->pointer = -1;		/* detection moved it around */
+	if (sample_interval > 0)
+		data->interval = sample_interval * HZ / 1000;
+	else
+		data->interval = LM77_DEFAULT_INTERVAL;
+	if (data->interval < 1)
+		data->interval = 1;
+	data->cur_interval = data->interval;
+	data->conv_period = ((long)LM77_MIN_INTERVAL_MS * HZ << LM77_CONV_SHIFT)
+	                    / 1000;
+	if (data->conv_period < 1)
+		data->conv_period = 1;
+	init_waitqueue_head(&data->alarm_wait);
+	spin_lock_init(&data->event_lock);
+	init_waitqueue_head(&data->event_wait);
+	INIT_TQUEUE(&data->irq_task, lm77_irq_work, data);
+	if (address >= LM77_ADDR_BASE && address < LM77_ADDR_BASE + 4)
+		data->irq = irq[address - LM77_ADDR_BASE];
+	if (history_size > 0)
+		lm77_history_alloc(data);
+	if (change_log > 0)
+		lm77_change_alloc(data);
 
 	/* Tell the I2C layer a new client has arrived */
 	if ((err = i2c_attach_client(new_client)))
 		goto error3;
 
+	/* Initialize the LM77 chip before anyone can read it through the
+	   sysctl entries, so that the cached limits are valid from the start */
+	lm77_init_client(new_client);
+
+	if (data->irq && request_irq(data->irq, lm77_interrupt, 0, "lm77",
+	                             data)) {
+		printk(KERN_WARNING "lm77: cannot get IRQ %d for bus %d, io %x, "
+		       "falling back to polling\n", data->irq,
+		       adapter->id, address);
+		data->irq = 0;
+		lm77_write_conf(new_client, data->conf & ~LM77_CONF_INTMODE);
+	}
+
+	/* Guard band mode only makes sense once INT is known to work */
+	if (guard_band > 0 && data->irq && !data->duty) {
+		lm77_lock(data);
+		lm77_guard_set(new_client, guard_band);
+		lm77_unlock(data);
+	}
+
 	/* Register a new directory entry with module sensors */
 	if ((i = i2c_register_entry(new_client, type_name,
 					lm77_dir_table_template,
@@ -305,181 +1454,1450 @@ int lm77_detect(struct i2c_adapter *adapter, int address,
 	}
 	data->sysctl_id = i;
 
-	/* Initialize the LM77 chip */
-	lm77_init_client(new_client);
+	down(&lm77_clients_lock);
+	list_add_tail(&data->list, &lm77_clients);
+	wake_up_interruptible(&lm77_sampler_wait);
+	data->slot = -1;
+	for (i = 0; i < LM77_MAX_CLIENTS; i++)
+		if (!lm77_slots[i]) {
+			lm77_slots[i] = data;
+			data->slot = i;
+			break;
+		}
+	up(&lm77_clients_lock);
+
+	if (data->slot < 0)
+		printk(KERN_NOTICE "lm77: no device slot left for bus %d, "
+		       "io %x\n", adapter->id, address);
+	else
+		printk(KERN_INFO "lm77: bus %d, io %x is slot %d, device "
+		       "%d,%d-%d\n", i2c_adapter_id(adapter), address,
+		       data->slot, lm77_major,
+		       data->slot << LM77_MINOR_SHIFT,
+		       (data->slot << LM77_MINOR_SHIFT) | LM77_NODE_MASK);
+
 	return 0;
 
 /* OK, this is not exactly good programming practice, usually. But it is
    very code-efficient in this case. */
 
       error4:
+	lm77_quiesce(new_client);
 	i2c_detach_client(new_client);
       error3:
       error1:
-	kfree(data);
+	/* remember plain detection failures, not errors */
+	if (kind < 0 && !err)
+		lm77_neg_add(adapter, address);
+	lm77_free_data(data);
       error0:
 	return err;
 }
 
 static void lm77_init_client(struct i2c_client *client)
 {
-	/* Initialize the LM77 chip - turn off shutdown mode */
-	u16 conf = lm77_read_value(client, LM77_REG_CONF);
+	/* Initialize the LM77 chip - turn off shutdown mode, unless we are
+	   going to duty cycle it anyway */
+	struct lm77_data *data = client->data;
+	const struct lm77_chip *chip = lm77_chip(data);
+	u8 regs[LM77_NUM_REGS], reg;
+	int vals[LM77_NUM_REGS], i;
+	u16 conf;
 	u16 new = 0;
+
+	/* A warm client gets everything in one go, vals[] is indexed by
+	   register number either way */
+	if (data->warm) {
+		for (i = 0; i < chip->nregs; i++)
+			regs[i] = i;
+		lm77_read_block(client, regs, chip->nregs, vals);
+	} else
+		vals[LM77_REG_CONF] = lm77_read_value(client, LM77_REG_CONF);
+	conf = vals[LM77_REG_CONF];
 	
-	if (conf & LM77_CONF_SHUTDOWN) {
+	data->duty = duty_cycle ? 1 : 0;
+	if (data->duty)
+		new |= LM77_CONF_SHUTDOWN;
+	else if (conf & LM77_CONF_SHUTDOWN) {
 		printk(KERN_INFO "lm77: waking up bus %d, io %x\n",
 			client->adapter->id, client->addr);
-		/* this is done automatically with the default for new */
+		/* this is done automatically with the default for new; this
+		   lets lm77_write_conf() know the conversions start over */
+		data->conf = LM77_CONF_SHUTDOWN;
 	}
 
-#ifdef LM77_FAULT_QUEUE
-	/* Define this at compile time in order to enable the fault queue
-	 * feature provided by the LM77. Refer to section 1.7 of the LM77
-	 * data sheet for further information.
-	 */
-	conf |= LM77_CONF_FAULTQ
-#endif
+	if (fault_queue)
+		new |= LM77_CONF_FAULTQ;
+	data->debounce = SENSORS_LIMIT(alarm_debounce, 0, LM77_MAX_DEBOUNCE);
+
+	/* INT is latched in interrupt mode and cleared again by reading any
+	   register, which lm77_irq_work() does */
+	if (data->irq)
+		new |= LM77_CONF_INTMODE;
+	if (int_active_high)
+		new |= LM77_CONF_INTPOL;
+	if (tcrit_active_high)
+		new |= LM77_CONF_TCRITPOL;
+
+	/* A chip that is configured that way already is left alone */
+	if (vals[LM77_REG_CONF] >= 0 && conf == new)
+		data->conf = new;
+	else
+		lm77_write_conf(client, new);
+
+	/* Fetch the limits once; from now on they are maintained by the
+	   write path in lm77_proc_temp(). A warm client has them already, and
+	   unless the chip has just been woken up, a valid reading too. */
+	if (data->warm) {
+		for (i = 0; i < LM77_LIMITS; i++) {
+			reg = chip->limit_regs[i];
+			lm77_mark(data, reg, vals[reg] >= 0);
+			if (vals[reg] >= 0)
+				lm77_set_reg(data, reg, vals[reg]);
+		}
+		data->limits_updated = jiffies;
+		if (vals[LM77_REG_TEMP] >= 0 && vals[LM77_REG_CONF] >= 0 &&
+		    conf == new &&
+		    !(new & LM77_CONF_SHUTDOWN))
+			lm77_seed(client, vals[0]);
+	} else
+		lm77_update_limits(client);
+	lm77_publish(data);
+}
+
+/* Stop the interrupt and hand the chip back the way we found it: real
+   limits, comparator mode, converting. Once this returns no
+   lm77_irq_work() is pending or running. */
+static void lm77_quiesce(struct i2c_client *client)
+{
+	struct lm77_data *data = client->data;
+
+	if (data->irq) {
+		/* let a pending lm77_irq_work() finish before the line goes */
+		disable_irq(data->irq);
+		flush_scheduled_tasks();
+		free_irq(data->irq, data);
+		data->irq = 0;
+	}
+
+	/* Put the real limits back, nobody is going to move the band now */
+	if (data->guard) {
+		lm77_lock(data);
+		lm77_guard_set(client, 0);
+		lm77_unlock(data);
+	}
 
-	lm77_write_value(client, LM77_REG_CONF, new);	
+	/* Leave the chip in comparator mode and converting, as we found it */
+	if ((data->conf & (LM77_CONF_INTMODE | LM77_CONF_SHUTDOWN)) &&
+	    lm77_write_conf(client, data->conf & ~(LM77_CONF_INTMODE |
+	                                           LM77_CONF_SHUTDOWN)) < 0)
+		printk(KERN_WARNING "lm77: bus %d, io %x: cannot put the "
+		       "chip back into comparator mode\n",
+		       i2c_adapter_id(client->adapter), client->addr);
 }
 
 static int lm77_detach_client(struct i2c_client *client)
 {
 	struct lm77_data *data = client->data;
 
+	down(&lm77_clients_lock);
+	list_del(&data->list);
+	if (data->slot >= 0)
+		lm77_slots[data->slot] = NULL;
+	data->users++;
+	/* From here on refreshes and sysctl writes leave the chip alone,
+	   so whatever lm77_quiesce() restores stays that way */
+	lm77_lock(data);
+	data->dead = 1;
+	lm77_unlock(data);
+	up(&lm77_clients_lock);
+
+	lm77_quiesce(client);
+
 	i2c_deregister_entry(data->sysctl_id);
 	i2c_detach_client(client);
-	kfree(client->data);
+
+	/* Open character devices keep the data around until they are
+	   closed; wake up any sleepers so that they notice */
+	wake_up_interruptible(&data->alarm_wait);
+	wake_up_interruptible(&data->event_wait);
+	lm77_put(data);
 	return 0;
 }
 
-
-
-/* All registers are word-sized, except for the configuration register.
-   The LM77 uses a high-byte first convention, which is exactly opposite to
-   the usual practice. */
-static int lm77_read_value(struct i2c_client *client, u8 reg)
+/* The history lives in reserved pages so that it can be remapped to user
+   space */
+static void lm77_history_reserve(unsigned long addr, int order, int reserve)
 {
-	if (reg == LM77_REG_CONF)
-		return i2c_smbus_read_byte_data(client, reg);
-	else
-		return swab16(i2c_smbus_read_word_data(client, reg));
+	struct page *page = virt_to_page(addr);
+	struct page *last = virt_to_page(addr + (PAGE_SIZE << order) - 1);
+
+	for (; page <= last; page++)
+		if (reserve)
+			SetPageReserved(page);
+		else
+			ClearPageReserved(page);
 }
 
-/* All registers are word-sized, except for the configuration register.
-   The LM77 uses a high-byte first convention, which is exactly opposite to
-   the usual practice. */
-static int lm77_write_value(struct i2c_client *client, u8 reg, u16 value)
+/* Failing to get the memory is not fatal; the client just has no history */
+static void lm77_history_alloc(struct lm77_data *data)
 {
-	if (reg == LM77_REG_CONF)
-		return i2c_smbus_write_byte_data(client, reg, value);
-	else
-		return i2c_smbus_write_word_data(client, reg, swab16(value));
+	unsigned long size, addr;
+	int n = 1, order;
+
+	while (n < history_size)
+		n <<= 1;
+	size = sizeof(struct lm77_history)
+	       + n * sizeof(struct lm77_history_entry);
+	order = get_order(size);
+
+	if (!(addr = __get_free_pages(GFP_KERNEL, order))) {
+		printk(KERN_WARNING "lm77: no memory for %d history samples\n",
+		       n);
+		return;
+	}
+	lm77_history_reserve(addr, order, 1);
+
+	data->history = (struct lm77_history *)addr;
+	data->history_order = order;
+	memset(data->history, 0, PAGE_SIZE << order);
+	data->history->magic = LM77_HISTORY_MAGIC;
+	data->history->size = n;
+	data->history->hz = HZ;
 }
 
-static void lm77_update_client(struct i2c_client *client)
+static void lm77_change_alloc(struct lm77_data *data)
 {
-	struct lm77_data *data = client->data;
+	int n = (change_log + LM77_CHANGE_BLOCK - 1) / LM77_CHANGE_BLOCK;
 
-	down(&data->update_lock);
-
-	if ((jiffies - data->last_updated > HZ + HZ / 2) ||
-	    (jiffies < data->last_updated) || !data->valid) {
-
-		pr_debug("Starting lm77 update\n");
-
-		data->temp_input =
-		    LM77_TEMP_FROM_REG(lm77_read_value(client,
-		                                       LM77_REG_TEMP));
-		data->temp_hyst =
-		    LM77_TEMP_FROM_REG(lm77_read_value(client,
-		                                       LM77_REG_T_HYST));
-		data->temp_crit =
-		    LM77_TEMP_FROM_REG(lm77_read_value(client,
-		                                       LM77_REG_T_CRIT));
-		data->temp_min =
-		    LM77_TEMP_FROM_REG(lm77_read_value(client,
-		                                       LM77_REG_T_LOW));
-		data->temp_max =
-		    LM77_TEMP_FROM_REG(lm77_read_value(client,
-		                                       LM77_REG_T_HIGH));
-		data->alarms =
-		    lm77_read_value(client, LM77_REG_TEMP) & LM77_ALARM_MASK;
-		    
-		data->last_updated = jiffies;
-		data->valid = 1;
-		
+	n = SENSORS_LIMIT(n, 2, LM77_CHANGE_MAX_BLOCKS);
+	if (!(data->changes = kmalloc(n * LM77_CHANGE_BLOCK, GFP_KERNEL))) {
+		printk(KERN_WARNING "lm77: no memory for %d bytes of change "
+		       "log\n", n * LM77_CHANGE_BLOCK);
+		return;
 	}
+	memset(data->changes, LM77_CHANGE_END, n * LM77_CHANGE_BLOCK);
+	data->change_blocks = n;
+}
 
-	up(&data->update_lock);
+static void lm77_free_data(struct lm77_data *data)
+{
+	unsigned long addr = (unsigned long)data->history;
+
+	if (addr) {
+		lm77_history_reserve(addr, data->history_order, 0);
+		free_pages(addr, data->history_order);
+	}
+	if (data->changes)
+		kfree(data->changes);
+	kfree(data);
+}
+
+/* The interrupt handler only masks the line and defers the bus access to
+   process context. Reading the temperature register there clears INT. */
+static void lm77_interrupt(int irq, void *dev_id, struct pt_regs *regs)
+{
+	struct lm77_data *data = dev_id;
+
+	disable_irq_nosync(irq);
+	schedule_task(&data->irq_task);
+}
+
+static void lm77_irq_work(void *arg)
+{
+	struct lm77_data *data = arg;
+
+	lm77_lock(data);
+	if (!data->dead)
+		lm77_refresh(&data->client);
+	lm77_unlock(data);
+
+	enable_irq(data->irq);
+}
+
+/* Append a transfer that started at start to the bus trace. Callers
+   check trace first, so this costs a single test while it is off. */
+static void lm77_trace_add(struct i2c_client *client, char op, u8 reg,
+			   int value, cycles_t start)
+{
+	struct lm77_trace *t;
+	cycles_t end = get_cycles();
+
+	spin_lock(&lm77_trace_lock);
+	t = &lm77_trace_ring[lm77_trace_head++ & (LM77_TRACE - 1)];
+	t->jiffies = jiffies;
+	t->cycles = end - start;
+	t->bus = i2c_adapter_id(client->adapter);
+	t->addr = client->addr;
+	t->reg = reg;
+	t->op = op;
+	t->value = value;
+	spin_unlock(&lm77_trace_lock);
+}
+
+
+
+/* Plain I2C backend, used if the adapter supports it. The pointer
+   register is remembered, so that reading the same register again (which
+   is what happens all the time for LM77_REG_TEMP) is one read message
+   without the write. */
+static int lm77_i2c_read(struct i2c_client *client, u8 reg)
+{
+	struct lm77_data *data = client->data;
+	u8 buf[2];
+	int len = lm77_reg_len(data, reg);
+	struct i2c_msg msg[2] = {
+		{ client->addr, 0, 1, &reg },
+		{ client->addr, I2C_M_RD, len, buf },
+	};
+	int first = (data->pointer == reg) ? 1 : 0;
+	int ret;
+
+	ret = i2c_transfer(client->adapter, msg + first, 2 - first);
+	if (ret != 2 - first) {
+		data->pointer = -1;
+		return ret < 0 ? ret : -EIO;
+	}
+	data->pointer = reg;
+
+	return (len == 1) ? buf[0] : (buf[0] << 8) | buf[1];
+}
+
+static int lm77_i2c_write(struct i2c_client *client, u8 reg, u16 value)
+{
+	struct lm77_data *data = client->data;
+	u8 buf[3] = { reg, value >> 8, value & 0xff };
+	struct i2c_msg msg = { client->addr, 0, 3, buf };
+	int ret;
+
+	if (lm77_reg_len(data, reg) == 1) {
+		buf[1] = value & 0xff;
+		msg.len = 2;
+	}
+
+	ret = i2c_transfer(client->adapter, &msg, 1);
+	if (ret != 1) {
+		data->pointer = -1;
+		return ret < 0 ? ret : -EIO;
+	}
+	data->pointer = reg;
+	return 0;
+}
+
+/* Wait before retry number n + 1 */
+static void lm77_backoff(int n)
+{
+	long t = (LM77_RETRY_MS << n) * HZ / 1000;
+
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_timeout(t < 1 ? 1 : t);
+}
+
+/* All registers are word-sized, except for those in byte_regs of the
+   chip (the configuration register of the LM77). Words are high-byte
+   first, which is exactly opposite to the usual practice. Errors are
+   negative, register values never are. */
+static int lm77_read_value(struct i2c_client *client, u8 reg)
+{
+	struct lm77_data *data = client->data;
+	cycles_t start;
+	int ret, n = 0;
+
+	for (;;) {
+		start = lm77_stat_now();
+		if (data->i2c_xfer)
+			ret = lm77_i2c_read(client, reg);
+		else if (lm77_reg_len(data, reg) == 1)
+			ret = i2c_smbus_read_byte_data(client, reg);
+		else if ((ret = i2c_smbus_read_word_data(client, reg)) >= 0)
+			ret = swab16(ret);
+		lm77_stat_bus(data, 0, 1, start, ret);
+		if (trace)
+			lm77_trace_add(client, 'r', reg, ret, start);
+
+		if (ret >= 0 || n >= retries)
+			return ret;
+		lm77_backoff(n++);
+	}
+}
+
+/* Same register sizes and byte order as lm77_read_value() */
+static int lm77_write_value(struct i2c_client *client, u8 reg, u16 value)
+{
+	struct lm77_data *data = client->data;
+	cycles_t start;
+	int ret, n = 0;
+
+	for (;;) {
+		start = lm77_stat_now();
+		if (data->i2c_xfer)
+			ret = lm77_i2c_write(client, reg, value);
+		else if (lm77_reg_len(data, reg) == 1)
+			ret = i2c_smbus_write_byte_data(client, reg, value);
+		else
+			ret = i2c_smbus_write_word_data(client, reg,
+			                                swab16(value));
+		lm77_stat_bus(data, 1, 1, start, ret);
+		if (trace)
+			lm77_trace_add(client, 'w', reg,
+			               ret < 0 ? ret : value, start);
+
+		if (ret >= 0 || n >= retries)
+			return ret;
+		lm77_backoff(n++);
+	}
+}
+
+/* Read up to LM77_BLOCK_MAX registers. With the plain I2C backend this is
+   a single i2c_transfer() of one write+read pair per register, otherwise
+   the registers are read one by one. If the combined transfer fails, the
+   registers are read one by one (with retries) as well. Failed reads give
+   the error code. */
+#define LM77_BLOCK_MAX 6
+
+static void lm77_read_block(struct i2c_client *client, const u8 *regs,
+			    int n, int *vals)
+{
+	struct lm77_data *data = client->data;
+	struct i2c_msg msg[2 * LM77_BLOCK_MAX];
+	u8 ptr[LM77_BLOCK_MAX], buf[LM77_BLOCK_MAX][2];
+	cycles_t start;
+	int i, ret;
+
+	if (!data->i2c_xfer || n < 2 || n > LM77_BLOCK_MAX) {
+		for (i = 0; i < n; i++)
+			vals[i] = lm77_read_value(client, regs[i]);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		ptr[i] = regs[i];
+		msg[2 * i].addr = client->addr;
+		msg[2 * i].flags = 0;
+		msg[2 * i].len = 1;
+		msg[2 * i].buf = &ptr[i];
+		msg[2 * i + 1].addr = client->addr;
+		msg[2 * i + 1].flags = I2C_M_RD;
+		msg[2 * i + 1].len = lm77_reg_len(data, regs[i]);
+		msg[2 * i + 1].buf = buf[i];
+	}
+
+	start = lm77_stat_now();
+	ret = i2c_transfer(client->adapter, msg, 2 * n);
+	lm77_stat_bus(data, 0, n, start, ret == 2 * n ? 0 : -EIO);
+	if (ret != 2 * n) {
+		if (trace)
+			lm77_trace_add(client, 'b', regs[0],
+			               ret < 0 ? ret : -EIO, start);
+		data->pointer = -1;
+		for (i = 0; i < n; i++)
+			vals[i] = lm77_read_value(client, regs[i]);
+		return;
+	}
+	data->pointer = regs[n - 1];
+
+	for (i = 0; i < n; i++) {
+		vals[i] = (lm77_reg_len(data, regs[i]) == 1) ? buf[i][0]
+		          : (buf[i][0] << 8) | buf[i][1];
+		if (trace)
+			lm77_trace_add(client, 'b', regs[i], vals[i], start);
+	}
+}
+
+/* Record the outcome of a register read for the status sysctl */
+static inline void lm77_mark(struct lm77_data *data, u8 reg, int ok)
+{
+	if (ok)
+		data->stale_since[reg] = 0;
+	else if (!data->stale_since[reg])
+		data->stale_since[reg] = jiffies | 1;
+}
+
+static int lm77_limits_stale(struct lm77_data *data)
+{
+	const u8 *regs = lm77_chip(data)->limit_regs;
+	int i;
+
+	for (i = 0; i < LM77_LIMITS; i++)
+		if (data->stale_since[regs[i]])
+			return 1;
+	return 0;
+}
+
+/* Read the four limit registers. A register that cannot be read keeps its
+   previous value. The caller must hold update_lock, unless nobody else
+   can know about the client yet. */
+static void lm77_update_limits(struct i2c_client *client)
+{
+	struct lm77_data *data = client->data;
+	const u8 *regs = lm77_chip(data)->limit_regs;
+	int vals[LM77_LIMITS], i;
+
+	lm77_read_block(client, regs, LM77_LIMITS, vals);
+	for (i = 0; i < LM77_LIMITS; i++) {
+		lm77_mark(data, regs[i], vals[i] >= 0);
+		if (vals[i] >= 0 && !lm77_guarded(data, regs[i]))
+			lm77_set_reg(data, regs[i], vals[i]);
+	}
+
+	data->limits_updated = jiffies;
+}
+
+/* Write the configuration register and remember what is in there. A chip
+   coming out of shutdown starts a new conversion, which tells us its
+   phase for free. If the write fails, data->conf keeps what the chip
+   still has and the error is returned. */
+static int lm77_write_conf(struct i2c_client *client, u8 conf)
+{
+	struct lm77_data *data = client->data;
+	int err;
+
+	if ((err = lm77_write_value(client, LM77_REG_CONF, conf)) < 0)
+		return err;
+	if ((data->conf & LM77_CONF_SHUTDOWN) && !(conf & LM77_CONF_SHUTDOWN)) {
+		data->conv_edge = jiffies
+		                  + (data->conv_period >> LM77_CONV_SHIFT);
+		data->conv_known = 1;
+	} else if (conf & LM77_CONF_SHUTDOWN)
+		data->conv_known = 0;
+	data->conf = conf;
+	return 0;
+}
+
+/* Wake a duty cycled chip up for one conversion and read the result. It
+   is put back into shutdown right away, so the temperature register (and
+   with it the alarm bits and the INT and T_CRIT_A outputs) is only
+   updated while a sample is being taken. The caller must hold
+   update_lock. */
+static int lm77_read_oneshot(struct i2c_client *client)
+{
+	struct lm77_data *data = client->data;
+	int temp;
+
+	/* A chip that did not wake up has nothing new to read */
+	if ((temp = lm77_write_conf(client, data->conf
+	                                    & ~LM77_CONF_SHUTDOWN)) < 0)
+		return temp;
+
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_timeout((LM77_CONV_MS * HZ + 999) / 1000);
+
+	temp = lm77_read_value(client, LM77_REG_TEMP);
+	lm77_write_conf(client, data->conf | LM77_CONF_SHUTDOWN);
+	return temp;
+}
+
+/* Take over freshly read alarm bits, unless debouncing holds them back.
+   A change that does not persist resets the count. */
+static void lm77_debounce(struct lm77_data *data, u8 alarms)
+{
+	if (data->debounce <= 1 || !data->valid || alarms == data->alarms) {
+		data->alarms = alarms;
+		data->alarm_count = 0;
+		return;
+	}
+
+	if (alarms != data->alarm_pending || !data->alarm_count) {
+		data->alarm_pending = alarms;
+		data->alarm_count = 0;
+	}
+	if (++data->alarm_count >= data->debounce) {
+		data->alarms = alarms;
+		data->alarm_count = 0;
+	}
+}
+
+/* In guard band mode the LOW and HIGH alarm bits of the chip belong to
+   the band, so they are worked out against the real limits instead, with
+   the same hysteresis as the chip applies. CRIT is still the chip's. */
+static u8 lm77_guard_alarms(struct lm77_data *data, int temp)
+{
+	const struct lm77_chip *chip = lm77_chip(data);
+	int t = chip->from_reg(temp);
+	int low = lm77_temp(data, chip->limit_regs[LM77_LIM_MIN]);
+	int high = lm77_temp(data, chip->limit_regs[LM77_LIM_MAX]);
+	int hyst = lm77_temp(data, chip->limit_regs[LM77_LIM_HYST]);
+	u8 alarms = temp & LM77_ALARM_CRIT;
+
+	if (t > high || ((data->alarms & LM77_ALARM_HIGH) && t > high - hyst))
+		alarms |= LM77_ALARM_HIGH;
+	if (t < low || ((data->alarms & LM77_ALARM_LOW) && t < low + hyst))
+		alarms |= LM77_ALARM_LOW;
+	return alarms;
+}
+
+/* Write one edge of the band (in tenths), unless it is already there */
+static void lm77_guard_write(struct i2c_client *client, u8 reg, u16 *cur,
+			     int temp)
+{
+	u16 val = lm77_chip(client->data)->to_reg(temp);
+
+	if (val == *cur)
+		return;
+	if (lm77_write_value(client, reg, val) < 0)
+		*cur = 0xffff;		/* try again next time */
+	else
+		*cur = val;
+}
+
+/* Center the band on the current reading. Where a real limit (or the
+   point its alarm clears at) is closer than the band edge, the edge is
+   put there instead, so that INT fires as soon as one of the alarms
+   changes, just like with the real limits in the chip. No edge comes
+   closer than T_HYST plus a step though, see guard_band. The caller must
+   hold update_lock. */
+static void lm77_guard_center(struct i2c_client *client)
+{
+	struct lm77_data *data = client->data;
+	const struct lm77_chip *chip = lm77_chip(data);
+	u8 low_reg = chip->limit_regs[LM77_LIM_MIN];
+	u8 high_reg = chip->limit_regs[LM77_LIM_MAX];
+	int t = lm77_temp(data, LM77_REG_TEMP);
+	int ulow = lm77_temp(data, low_reg);
+	int uhigh = lm77_temp(data, high_reg);
+	int hyst = lm77_temp(data, chip->limit_regs[LM77_LIM_HYST]);
+	int step = chip->step;
+	int band = max(data->guard / step, 1) * step;
+	int low = t - band, high = t + band;
+
+	if (t <= uhigh)
+		high = min(high, uhigh);
+	else
+		low = max(low, uhigh - hyst + step);
+	if (t >= ulow)
+		low = max(low, ulow);
+	else
+		high = min(high, ulow + hyst - step);
+
+	/* far enough for the chip to re-arm the edge */
+	low = min(low, t - hyst - step);
+	high = max(high, t + hyst + step);
+
+	lm77_guard_write(client, low_reg, &data->guard_low, low);
+	lm77_guard_write(client, high_reg, &data->guard_high, high);
+}
+
+/* Write the real limits back that are still missing in the chip. Those
+   that do not take stay in guard_restore, and are tried again on every
+   refresh; the shadow keeps them meanwhile. The caller must hold
+   update_lock. */
+static void lm77_guard_restore(struct i2c_client *client)
+{
+	struct lm77_data *data = client->data;
+	static const u8 regs[2] = { LM77_REG_T_LOW, LM77_REG_T_HIGH };
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if ((data->guard_restore & (1 << regs[i])) &&
+		    lm77_write_value(client, regs[i],
+		                     data->reg[regs[i]]) >= 0)
+			data->guard_restore &= ~(1 << regs[i]);
+}
+
+/* Turn guard band mode on (guard in tenths of a degree) or off. Turning
+   it on takes a reading to center the band on; turning it off writes the
+   real limits back. The caller must hold update_lock. */
+static void lm77_guard_set(struct i2c_client *client, int guard)
+{
+	struct lm77_data *data = client->data;
+
+	guard = SENSORS_LIMIT(guard, 0, LM77_TEMP_MAX - LM77_TEMP_MIN);
+	if (guard == data->guard)
+		return;
+
+	if (!guard) {
+		data->guard = 0;
+		data->guard_restore = (1 << LM77_REG_T_LOW)
+		                      | (1 << LM77_REG_T_HIGH);
+		lm77_guard_restore(client);
+		if (data->guard_restore)
+			printk(KERN_WARNING "lm77: bus %d, io %x: cannot put "
+			       "the limits back yet\n",
+			       i2c_adapter_id(client->adapter), client->addr);
+		data->cur_interval = data->interval;
+		lm77_publish(data);
+	} else {
+		if (!data->guard)
+			data->guard_low = data->guard_high = 0xffff;
+		data->guard = guard;
+		data->guard_restore = 0;
+		lm77_refresh(client);
+	}
+	data->scheduled = 0;
+	wake_up_interruptible(&lm77_sampler_wait);
+}
+
+/* A refresh failed even after the retries. The previous readings stay (and
+   stay published), and the next attempt is not before the cache lifetime
+   is over. Once the error budget is used up that lifetime doubles with
+   every further failure. */
+static void lm77_refresh_failed(struct i2c_client *client)
+{
+	struct lm77_data *data = client->data;
+	long limit = LM77_MAX_INTERVAL_MS * HZ / 1000;
+	int shift;
+
+	lm77_mark(data, LM77_REG_TEMP, 0);
+	data->errors++;
+	data->last_try = jiffies;
+	if (data->guard) {
+		/* the band was not moved, so poll until it can be */
+		data->cur_interval = data->interval;
+		lm77_publish(data);
+	}
+
+	if (error_budget <= 0 || data->errors < error_budget)
+		return;
+	if (data->errors == error_budget)
+		printk(KERN_WARNING "lm77: bus %d, io %x keeps failing, "
+		       "backing off\n", i2c_adapter_id(client->adapter),
+		       client->addr);
+
+	shift = min(data->errors - error_budget + 1, LM77_MAX_BACKOFF);
+	data->cur_interval = data->interval << shift;
+	if (data->cur_interval > limit)
+		data->cur_interval = max(limit, data->interval);
+	lm77_publish(data);
+}
+
+/* Take a reading from the warm attach batch as the first sample, so that
+   nobody has to wait for a refresh. Alarms are taken as they are; there
+   is nothing to debounce against yet. The caller must be the only one
+   who knows about the client. */
+static void lm77_seed(struct i2c_client *client, int temp)
+{
+	struct lm77_data *data = client->data;
+
+	lm77_mark(data, LM77_REG_TEMP, 1);
+	lm77_set_reg(data, LM77_REG_TEMP, temp);
+	data->alarms = temp & lm77_chip(data)->alarm_mask;
+	data->alarm_pending = data->alarms;
+	data->event_temp = lm77_temp(data, LM77_REG_TEMP);
+	lm77_history_add(data, temp);
+	lm77_change_add(data, temp);
+	lm77_trend_add(data);
+	data->last_updated = jiffies;
+	data->last_try = data->last_updated;
+	data->valid = 1;
+}
+
+/* The alarm bits live in the lowest three bits of the temperature
+   register, so one read refreshes both the temperature and alarms. The limit
+   registers are only re-read if limit_resync asks for it, or if reading
+   them failed before. The caller must hold update_lock. */
+static void lm77_refresh(struct i2c_client *client)
+{
+	struct lm77_data *data = client->data;
+	int temp, changed, first = !data->valid;
+	int old_temp = lm77_temp(data, LM77_REG_TEMP);
+	u8 old_alarms = data->alarms;
+
+	pr_debug("Starting lm77 update\n");
+
+	if (data->duty)
+		temp = lm77_read_oneshot(client);
+	else
+		temp = lm77_read_value(client, LM77_REG_TEMP);
+
+	if (temp < 0) {
+		lm77_refresh_failed(client);
+		return;
+	}
+	lm77_mark(data, LM77_REG_TEMP, 1);
+	if (error_budget > 0 && data->errors >= error_budget) {
+		printk(KERN_INFO "lm77: bus %d, io %x is back\n",
+		       i2c_adapter_id(client->adapter), client->addr);
+		data->cur_interval = data->interval;
+	}
+	data->errors = 0;
+
+	/* The same raw value again is most likely the same conversion, so
+	   it does not go into the history either */
+	changed = !data->valid || temp != data->reg[LM77_REG_TEMP];
+	lm77_conv_seen(data, jiffies, changed);
+	lm77_set_reg(data, LM77_REG_TEMP, temp);
+	if (data->guard || data->guard_restore)
+		lm77_debounce(data, lm77_guard_alarms(data, temp));
+	else
+		lm77_debounce(data, temp & lm77_chip(data)->alarm_mask);
+	if (changed) {
+		lm77_history_add(data, temp);
+		lm77_change_add(data, temp);
+	} else
+		LM77_STAT_INC(data, repeats);
+
+	if (((limit_resync > 0) &&
+	     ((jiffies - data->limits_updated > limit_resync * HZ) ||
+	      (jiffies < data->limits_updated))) || lm77_limits_stale(data))
+		lm77_update_limits(client);
+	if (data->guard)
+		lm77_guard_center(client);
+	else if (data->guard_restore)
+		lm77_guard_restore(client);
+
+	lm77_adapt_interval(data, old_temp);
+	lm77_trend_add(data);
+	data->last_updated = jiffies;
+	data->last_try = data->last_updated;
+	data->valid = 1;
+
+	lm77_publish(data);
+
+	if (data->alarms != old_alarms) {
+		data->alarm_gen++;
+		wake_up_interruptible(&data->alarm_wait);
+		lm77_event_add(data, LM77_EVENT_ALARM,
+		               data->alarms ^ old_alarms);
+	}
+	/* Temperature events are measured from the first valid reading,
+	   as with lm77_seed() */
+	temp = lm77_temp(data, LM77_REG_TEMP);
+	if (first)
+		data->event_temp = temp;
+	else if (event_delta > 0 &&
+	         (temp >= data->event_temp + event_delta ||
+	          temp <= data->event_temp - event_delta))
+		lm77_event_add(data, LM77_EVENT_TEMP, 0);
+}
+
+/* Learn the conversion cadence from a reading taken at now. If TEMP
+   changed since the previous reading and that was less than a period
+   ago, a conversion finished in between: now is a conversion edge, give
+   or take the gap. Edges a few periods apart also measure the period,
+   which is averaged since each edge is only that exact. A duty cycled
+   chip only converts when asked to, so there is nothing to learn. The
+   caller must hold update_lock, and call this before last_updated is
+   set. */
+static void lm77_conv_seen(struct lm77_data *data, unsigned long now,
+                           int changed)
+{
+	long lo = ((long)LM77_MIN_INTERVAL_MS * HZ << LM77_CONV_SHIFT) / 2000;
+	long hi = ((long)LM77_CONV_MS * HZ << LM77_CONV_SHIFT) * 2 / 1000;
+	unsigned long d;
+	long k;
+
+	if (data->duty || !data->valid || !changed)
+		return;
+	if (now - data->last_updated
+	    > (unsigned long)(data->conv_period >> LM77_CONV_SHIFT))
+		return;		/* too far apart to tell when */
+
+	d = now - data->conv_edge;
+	if (data->conv_known && time_after(now, data->conv_edge) &&
+	    d <= (LM77_CONV_STEPS * data->conv_period) >> LM77_CONV_SHIFT) {
+		d <<= LM77_CONV_SHIFT;
+		k = (d + data->conv_period / 2) / data->conv_period;
+		if (k >= 1) {
+			data->conv_period = (3 * data->conv_period + d / k) / 4;
+			data->conv_period = SENSORS_LIMIT(data->conv_period,
+			                                  max(lo, 1L), hi);
+		}
+	}
+	data->conv_edge = now;
+	data->conv_known = 1;
+}
+
+/* When, at t or later, the next conversion should be ready. That is t
+   itself unless the phase is known; otherwise it is the first edge not
+   before t, plus a jiffy so the result is there for sure. */
+static unsigned long lm77_next_conv(struct lm77_data *data, unsigned long t)
+{
+	unsigned long d;
+	long n;
+
+	if (!data->conv_known || data->duty)
+		return t;
+	if (time_before_eq(t, data->conv_edge))
+		return data->conv_edge + 1;
+
+	d = t - data->conv_edge;
+	if (d > (LM77_CONV_STEPS * data->conv_period) >> LM77_CONV_SHIFT)
+		return t;	/* drifted too far */
+	d <<= LM77_CONV_SHIFT;
+	n = (d + data->conv_period - 1) / data->conv_period;
+	return data->conv_edge + ((n * data->conv_period) >> LM77_CONV_SHIFT)
+	       + 1;
+}
+
+/* Can the chip have a reading newer than the one at last_updated? Without
+   a known phase that takes one conversion period. */
+static int lm77_conv_ready(struct lm77_data *data)
+{
+	unsigned long t = data->last_updated + 1;
+	unsigned long next = lm77_next_conv(data, t);
+
+	if (data->duty)
+		return 1;
+	if (next == t)
+		next = data->last_updated
+		       + (data->conv_period >> LM77_CONV_SHIFT);
+	return time_after_eq(jiffies, next);
+}
+
+/* Pick the cache lifetime after a refresh. Called by lm77_refresh() with
+   the previous temperature, before valid is set for the first time. */
+static void lm77_adapt_interval(struct lm77_data *data, int old_temp)
+{
+	const u8 *regs = lm77_chip(data)->limit_regs;
+	long fast = data->interval / 4;
+	long floor = LM77_MIN_INTERVAL_MS * HZ / 1000;
+	int temp = lm77_temp(data, LM77_REG_TEMP);
+
+	if (data->guard) {
+		data->cur_interval = max((long)LM77_GUARD_INTERVAL, data->interval);
+		return;
+	}
+	if (!data->adaptive) {
+		data->cur_interval = data->interval;
+		return;
+	}
+
+	if (fast < floor)
+		fast = floor;
+	if (fast < 1)
+		fast = 1;
+
+	if (!data->valid || temp != old_temp || data->alarm_count
+	    || temp >= lm77_temp(data, regs[LM77_LIM_MAX]) - LM77_ADAPT_MARGIN
+	    || temp >= lm77_temp(data, regs[LM77_LIM_CRIT]) - LM77_ADAPT_MARGIN)
+		data->cur_interval = fast;
+	else if (data->cur_interval < data->interval * 4)
+		data->cur_interval = min(data->cur_interval * 2,
+		                         data->interval * 4);
+}
+
+/* Feed a new temperature into the moving averages and the current bucket.
+   Each average moves towards the reading by dt / (tau + dt), which makes
+   it independent of how often the client is refreshed. dt is capped at
+   tau, so that a long gap weighs no more than one time constant. Called
+   by lm77_refresh() before valid is set for the first time. */
+static void lm77_trend_add(struct lm77_data *data)
+{
+	struct lm77_bucket *b;
+	unsigned long now = jiffies, epoch, dt, tau, w;
+	int cur = lm77_temp(data, LM77_REG_TEMP);
+	long temp = (long)cur << LM77_EWMA_SHIFT;
+	int i;
+
+	dt = now - data->ewma_time;
+	for (i = 0; i < 3; i++) {
+		if (!data->valid) {
+			data->ewma[i] = temp;
+			continue;
+		}
+		tau = SENSORS_LIMIT(ewma_tau[i], 1, 3600) * HZ;
+		w = min(dt, tau) * LM77_EWMA_ONE / (tau + min(dt, tau));
+		data->ewma[i] += (temp - data->ewma[i]) * (long)w
+		                 / LM77_EWMA_ONE;
+	}
+	data->ewma_time = now;
+
+	epoch = now / (LM77_BUCKET_SECS * HZ);
+	b = &data->bucket[epoch % LM77_BUCKETS];
+	if (b->epoch != epoch || !b->count) {
+		b->epoch = epoch;
+		b->min = b->max = cur;
+		b->sum = 0;
+		b->count = 0;
+	}
+	if (cur < b->min)
+		b->min = cur;
+	if (cur > b->max)
+		b->max = cur;
+	b->sum += cur;
+	b->count++;
+}
+
+/* Is a reading taken at last_updated past the cache lifetime? */
+static inline int lm77_expired(unsigned long last_updated, long interval)
+{
+	return (jiffies - last_updated > interval) ||
+	       (jiffies < last_updated);
+}
+
+/* Has the cache lifetime of the client expired? Needs update_lock. After
+   a failed refresh the lifetime counts from that attempt, valid or not. */
+static int lm77_stale(struct lm77_data *data)
+{
+	return (!data->valid && !data->errors) ||
+	       lm77_expired(data->last_try, data->cur_interval);
+}
+
+static void lm77_update_client(struct i2c_client *client)
+{
+	struct lm77_data *data = client->data;
+
+	lm77_lock(data);
+
+	/* Detached from the bus, only the last sample is left */
+	if (data->dead) {
+		lm77_unlock(data);
+		return;
+	}
+
+	/* Reading again before the next conversion is done would only
+	   return the same value at the cost of a bus transfer */
+	if (lm77_stale(data) && data->valid && !data->errors &&
+	    !lm77_conv_ready(data))
+		LM77_STAT_INC(data, waits);
+	else if (lm77_stale(data)) {
+		LM77_STAT_INC(data, misses);
+		lm77_refresh(client);
+	} else
+		LM77_STAT_INC(data, hits);
+
+	lm77_unlock(data);
+}
+
+/* Move the fixed point averages back to tenths of a degree, rounding */
+static inline long lm77_ewma_value(long v)
+{
+	long half = 1 << (LM77_EWMA_SHIFT - 1);
+
+	return (v >= 0 ? v + half : v - half) / (1 << LM77_EWMA_SHIFT);
+}
+
+/* Make the current readings visible to lm77_get_sample(). The caller must
+   hold update_lock (or be the only one who knows about the client), so
+   there is only ever one writer and a bare sequence counter does the job
+   of a seqlock, which 2.4 does not have. */
+static void lm77_publish(struct lm77_data *data)
+{
+	struct lm77_sample *s = &data->pub;
+	long period = data->conv_period >> LM77_CONV_SHIFT;
+	unsigned long conv;
+	int i;
+
+	/* The last edge before the reading; without a known phase that is
+	   a full period before it */
+	conv = lm77_next_conv(data, data->last_updated - period);
+	if (data->duty || time_after(conv, data->last_updated))
+		conv = data->last_updated;
+
+	data->pub_seq++;
+	smp_wmb();
+
+	s->valid = data->valid;
+	s->last_updated = data->last_updated;
+	for (i = 0; i < lm77_chip(data)->nregs; i++)
+		if (data->dirty & (1 << i))
+			s->reg[i] = data->reg[i];
+	s->reg[LM77_REG_CONF] = data->conf;
+	s->alarms = data->alarms;
+	s->interval = data->cur_interval;
+	for (i = 0; i < 3; i++)
+		s->avg[i] = lm77_ewma_value(data->ewma[i]);
+	s->conv = conv;
+	data->dirty = 0;
+
+	smp_wmb();
+	data->pub_seq++;
+}
+
+/* Copy out the latest readings. As long as the published sample is still
+   fresh (or the sampler thread keeps it fresh) this is a handful of loads:
+   no semaphore, no bus access, no sleeping. Only readers of a stale or
+   not yet valid sample go on to lm77_update_client(), so they queue on
+   update_lock while the refresh is in progress. */
+static void lm77_get_sample(struct i2c_client *client, struct lm77_sample *s)
+{
+	struct lm77_data *data = client->data;
+
+	lm77_read_snapshot(data, s);
+	if (s->valid && (lm77_sampler_pid ||
+	                 !lm77_expired(s->last_updated, s->interval))) {
+		LM77_STAT_INC(data, hits);
+		return;
+	}
+
+	lm77_update_client(client);
+	lm77_read_snapshot(data, s);
+}
+
+static void lm77_read_snapshot(struct lm77_data *data, struct lm77_sample *s)
+{
+	unsigned int seq;
+
+	for (;;) {
+		seq = data->pub_seq;
+		smp_rmb();
+		if (seq & 1)
+			continue;	/* lm77_publish() is running */
+		*s = data->pub;
+		smp_rmb();
+		if (seq == data->pub_seq)
+			break;
+		LM77_STAT_INC(data, retries);
+	}
+}
+
+/* Append a raw reading to the history. The caller must hold update_lock;
+   readers only ever look at the mapping. */
+static void lm77_history_add(struct lm77_data *data, int temp)
+{
+	struct lm77_history *h = data->history;
+	struct lm77_history_entry *e;
+
+	if (!h)
+		return;
+
+	e = &h->entry[h->head & (h->size - 1)];
+	e->jiffies = jiffies;
+	e->temp = temp;
+	smp_wmb();
+	h->head++;
+}
+
+/* Turn the calling kernel_thread() into a proper daemon that ignores all
+   signals */
+static void lm77_daemonize(const char *name)
+{
+	daemonize();
+	reparent_to_init();
+	strcpy(current->comm, name);
+
+	spin_lock_irq(&current->sigmask_lock);
+	sigfillset(&current->blocked);
+	recalc_sigpending(current);
+	spin_unlock_irq(&current->sigmask_lock);
+}
+
+/* Find the position of a client among the n clients on its adapter, for
+   lm77_stagger(). The caller must hold lm77_clients_lock. */
+static int lm77_position(struct lm77_data *data, int *n)
+{
+	struct list_head *pos;
+	struct lm77_data *other;
+	int index = 0;
+
+	*n = 0;
+	list_for_each(pos, &lm77_clients) {
+		other = list_entry(pos, struct lm77_data, list);
+		if (other->client.adapter != data->client.adapter)
+			continue;
+		if (other == data)
+			index = *n;
+		(*n)++;
+	}
+	return index;
+}
+
+/* Give a client its first sampler deadline. Clients on the same adapter
+   are spread evenly over the cache lifetime by their position on it, so
+   that their refreshes do not all hit the bus at once. From then on each
+   client keeps its phase, moving on by its own cur_interval. The caller
+   must hold update_lock. */
+static void lm77_stagger(struct lm77_data *data, unsigned long now,
+			 int index, int n)
+{
+	data->due = now + data->cur_interval * index / (n ? n : 1);
+	data->scheduled = 1;
+}
+
+static int lm77_put_varint(u8 *p, u32 v)
+{
+	int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+/* Append a raw reading to the change log if it differs from the last
+   one. A new block is started, overwriting the oldest, whenever the
+   records do not fit or the temperature jumped too far for a delta. The
+   caller must hold update_lock. */
+static void lm77_change_add(struct lm77_data *data, int temp)
+{
+	u8 rec[LM77_CHANGE_REC], *p;
+	unsigned long now = jiffies, dt = now - data->change_time;
+	const struct lm77_chip *chip = lm77_chip(data);
+	int steps = chip->from_reg(temp) / chip->step;
+	int alarms = temp & chip->alarm_mask;
+	int d = steps - data->change_temp;
+	int n = 0;
+
+	if (!data->changes)
+		return;
+
+	if (data->change_off) {
+		if (!d && alarms == data->change_alarms)
+			return;
+
+		if (d >= -32 && d <= 31) {
+			if (d) {
+				rec[n++] = d & 0x3f;
+				n += lm77_put_varint(rec + n, dt);
+				dt = 0;
+			}
+			if (alarms != data->change_alarms) {
+				rec[n++] = LM77_CHANGE_ALARMS | alarms;
+				n += lm77_put_varint(rec + n, dt);
+			}
+		}
+		if (data->change_off + n > LM77_CHANGE_BLOCK)
+			n = 0;
+	}
+
+	if (!n) {
+		/* start a new block with a keyframe */
+		p = data->changes + (data->change_head % data->change_blocks)
+		                    * LM77_CHANGE_BLOCK;
+		memset(p, LM77_CHANGE_END, LM77_CHANGE_BLOCK);
+		data->change_head++;
+		data->change_off = 0;
+
+		rec[n++] = LM77_CHANGE_KEY;
+		rec[n++] = now;
+		rec[n++] = now >> 8;
+		rec[n++] = now >> 16;
+		rec[n++] = now >> 24;
+		rec[n++] = temp;
+		rec[n++] = temp >> 8;
+	}
+
+	p = data->changes + ((data->change_head - 1) % data->change_blocks)
+	                    * LM77_CHANGE_BLOCK;
+	memcpy(p + data->change_off, rec, n);
+	data->change_off += n;
+	data->change_time = now;
+	data->change_temp = steps;
+	data->change_alarms = alarms;
+}
+
+/* Copy the change log, blocks in stream order, into a buffer of its own
+   for lm77_read_changes() */
+static int lm77_change_copy(struct lm77_data *data, struct lm77_file *f)
+{
+	struct lm77_changes h;
+	unsigned int first, blocks, i;
+
+	if (!data->changes)
+		return -ENODEV;
+
+	f->buf = kmalloc(sizeof(h) + data->change_blocks * LM77_CHANGE_BLOCK,
+	                 GFP_KERNEL);
+	if (!f->buf)
+		return -ENOMEM;
+
+	lm77_lock(data);
+	blocks = min(data->change_head, (unsigned int)data->change_blocks);
+	first = data->change_head - blocks;
+
+	h.magic = LM77_CHANGES_MAGIC;
+	h.hz = HZ;
+	h.block_size = LM77_CHANGE_BLOCK;
+	h.blocks = blocks;
+	memcpy(f->buf, &h, sizeof(h));
+	for (i = 0; i < blocks; i++)
+		memcpy(f->buf + sizeof(h) + i * LM77_CHANGE_BLOCK,
+		       data->changes + ((first + i) % data->change_blocks)
+		                       * LM77_CHANGE_BLOCK,
+		       LM77_CHANGE_BLOCK);
+	lm77_unlock(data);
+
+	f->len = sizeof(h) + blocks * LM77_CHANGE_BLOCK;
+	return 0;
+}
+
+/* Queue an event for the readers of the event device, overwriting the
+   oldest one if the ring is full. The caller must hold update_lock. */
+static void lm77_event_add(struct lm77_data *data, int type, u8 changed)
+{
+	struct lm77_event *e;
+
+	int temp = lm77_temp(data, LM77_REG_TEMP);
+
+	if (type == LM77_EVENT_TEMP)
+		data->event_temp = temp;
+
+	spin_lock(&data->event_lock);
+	e = &data->events[data->event_head % LM77_EVENTS];
+	e->seq = data->event_head;
+	e->jiffies = data->last_updated;
+	e->type = type;
+	e->alarms = data->alarms;
+	e->changed = changed;
+	e->temp = temp;
+	data->event_head++;
+	spin_unlock(&data->event_lock);
+
+	wake_up_interruptible(&data->event_wait);
+	kill_fasync(&data->event_fasync, SIGIO, POLL_IN);
+}
+
+static int lm77_sampler(void *unused)
+{
+	struct list_head *pos;
+	struct lm77_data *data;
+	int index, n, last;
+	long interval = sample_interval * HZ / 1000;
+	long coalesce = LM77_COALESCE_MS * HZ / 1000;
+	long timeout, left;
+	unsigned long now;
+
+	if (interval < 1)
+		interval = 1;
+
+	lm77_daemonize("klm77d");
+
+	/* Refresh whatever is due (or about to be), then sleep until the
+	   next client is. The sleep is capped at sample_interval so that
+	   newly attached clients are picked up in time. */
+	while (!lm77_sampler_stop) {
+		timeout = interval;
+		now = jiffies;
+
+		/* Each client is pinned while it is refreshed, so that the
+		   list lock is not held across bus transfers: attaching,
+		   detaching and opening other clients do not wait for them */
+		down(&lm77_clients_lock);
+		pos = lm77_clients.next;
+		while (pos != &lm77_clients) {
+			data = list_entry(pos, struct lm77_data, list);
+			index = lm77_position(data, &n);
+			data->users++;
+			up(&lm77_clients_lock);
+
+			lm77_lock(data);
+			if (!data->dead) {
+				if (!data->scheduled)
+					lm77_stagger(data, now, index, n);
+				if (time_after_eq(now + coalesce, data->due)) {
+					lm77_refresh(&data->client);
+					data->due = lm77_next_conv(data,
+					        jiffies + data->cur_interval);
+				}
+				left = data->due - jiffies;
+				if (left < timeout)
+					timeout = left;
+			}
+			lm77_unlock(data);
+
+			/* A client detached meanwhile is off the list, so
+			   start over; the clients done already are not due
+			   again and are passed over */
+			down(&lm77_clients_lock);
+			pos = data->dead ? lm77_clients.next : data->list.next;
+			last = !--data->users && data->dead;
+			if (last) {
+				up(&lm77_clients_lock);
+				lm77_free_data(data);
+				down(&lm77_clients_lock);
+				pos = lm77_clients.next;
+			}
+		}
+		up(&lm77_clients_lock);
+
+		if (timeout < 1)
+			timeout = 1;
+		interruptible_sleep_on_timeout(&lm77_sampler_wait, timeout);
+	}
+
+	complete_and_exit(&lm77_sampler_exit, 0);
+}
+
+static void lm77_stop_sampler(void)
+{
+	if (lm77_sampler_pid > 0) {
+		lm77_sampler_stop = 1;
+		wake_up_interruptible(&lm77_sampler_wait);
+		wait_for_completion(&lm77_sampler_exit);
+		lm77_sampler_pid = 0;
+	}
 }
 
 void lm77_proc_temp(struct i2c_client *client, int operation, int ctl_name,
 	       int *nrels_mag, long *results)
 {
 	struct lm77_data *data = client->data;
-	int new[4] = { LM77_SC_NOTSET, LM77_SC_NOTSET,
-		       LM77_SC_NOTSET, LM77_SC_NOTSET };
-	int check[4];
-	int passed = 1;
+	const struct lm77_chip *chip = lm77_chip(data);
+	struct lm77_sample s;
+	int new[LM77_LIMITS] = { LM77_SC_NOTSET, LM77_SC_NOTSET,
+		                 LM77_SC_NOTSET, LM77_SC_NOTSET };
+	int check[LM77_LIMITS];
+	int cur[LM77_LIMITS];
+	u8 regs[LM77_LIMITS], reg;
+	u16 old[LM77_LIMITS], want[LM77_LIMITS], val;
+	int idx[LM77_LIMITS], vals[LM77_LIMITS];
+	int i, n, moved, failed, passed = 1;
 
 	if (operation == SENSORS_PROC_REAL_INFO)
-		*nrels_mag = 1;
+		*nrels_mag = lm77_mag();
 	else if (operation == SENSORS_PROC_REAL_READ) {
-		lm77_update_client(client);
+		lm77_get_sample(client, &s);
 		
 		switch(ctl_name) {
 		case LM77_SYSCTL_TEMP:
-			results[0] = data->temp_min;
-			results[1] = data->temp_max;
-			results[2] = data->temp_input;
+			results[0] = lm77_out(data, &s,
+			                      chip->limit_regs[LM77_LIM_MIN]);
+			results[1] = lm77_out(data, &s,
+			                      chip->limit_regs[LM77_LIM_MAX]);
+			results[2] = lm77_out(data, &s, LM77_REG_TEMP);
 			*nrels_mag = 3;
 			break;
 			
 		case LM77_SYSCTL_TEMP_CRIT:
-			results[0] = data->temp_crit;
+			results[0] = lm77_out(data, &s,
+			                      chip->limit_regs[LM77_LIM_CRIT]);
 			*nrels_mag = 1;
 			break;
 		
 		case LM77_SYSCTL_TEMP_HYST:
-			results[0] = data->temp_hyst;
+			results[0] = lm77_out(data, &s,
+			                      chip->limit_regs[LM77_LIM_HYST]);
 			*nrels_mag = 1;
 			break;
 		}
 	} else if (operation == SENSORS_PROC_REAL_WRITE) {
 		switch(ctl_name) {
 		case LM77_SYSCTL_TEMP:
-			if (*nrels_mag >= 1)
-				new[0] = results[0];
-			if (*nrels_mag >= 2)
-				new[1] = results[1];
+			if (*nrels_mag >= 1) {
+				new[LM77_LIM_MIN] = lm77_in(results[0]);
+				want[LM77_LIM_MIN] = lm77_in_reg(data, results[0]);
+			}
+			if (*nrels_mag >= 2) {
+				new[LM77_LIM_MAX] = lm77_in(results[1]);
+				want[LM77_LIM_MAX] = lm77_in_reg(data, results[1]);
+			}
 			break;
 		
 		case LM77_SYSCTL_TEMP_CRIT:
-			if (*nrels_mag >= 1)
-				new[2] = results[0];
+			if (*nrels_mag >= 1) {
+				new[LM77_LIM_CRIT] = lm77_in(results[0]);
+				want[LM77_LIM_CRIT] = lm77_in_reg(data, results[0]);
+			}
 			break;
 		
 		case LM77_SYSCTL_TEMP_HYST:
-			if (*nrels_mag >= 1)
-				new[3] = results[0];
+			if (*nrels_mag >= 1) {
+				new[LM77_LIM_HYST] = lm77_in(results[0]);
+				want[LM77_LIM_HYST] = lm77_in_reg(data, results[0]);
+			}
 			break;
 		}
 
+		/* Checks and writes form one transaction, so that neither
+		 * a refresh nor a concurrent write can get in between.
+		 */
+		if (!lm77_lock_live(data))
+			return;
+
 		/* populate check array; use current values where
 		 * user didn't specify something else.
 		 *
-		 * mapping (also valid for new[]):
-		 * check[0] = temp_min
-		 * check[1] = temp_max
-		 * check[2] = temp_crit
-		 * check[3] = temp_hyst
+		 * check[], new[], want[] and cur[] are indexed by
+		 * LM77_LIM_*, like the limit_regs of the chip. The checks
+		 * are done in tenths of a degree; want[] is what goes into
+		 * the register, converted from the value as written.
 		 */
-		check[0] = (new[0] == LM77_SC_NOTSET) ? data->temp_min : new[0];
-		check[1] = (new[1] == LM77_SC_NOTSET) ? data->temp_max : new[1];
-		check[2] = (new[2] == LM77_SC_NOTSET) ? data->temp_crit : new[2];
-		check[3] = (new[3] == LM77_SC_NOTSET) ? data->temp_hyst : new[3];
+		for (i = 0; i < LM77_LIMITS; i++) {
+			cur[i] = lm77_temp(data, chip->limit_regs[i]);
+			check[i] = (new[i] == LM77_SC_NOTSET) ? cur[i] : new[i];
+		}
 
 		/* check 1: LM77_TEMP_MIN >= temp_min <= LM77_TEMP_MAX */
 		if ((check[0] < LM77_TEMP_MIN) ||
@@ -501,63 +2919,446 @@ void lm77_proc_temp(struct i2c_client *client, int operation, int ctl_name,
 			passed = 0;
 		}
 
-		/* 4. check[0] + check[4] < check[1] - check[4]
+		/* 4. check[0] + check[3] < check[1] - check[3]
 		 *    (see data sheet, sect. 1.1.2, page 8)
 		 */
-		if ((check[0] + check[4]) >= (check[1] - check[4])) {
+		if ((check[0] + check[3]) >= (check[1] - check[3])) {
 			printk(KERN_NOTICE "lm77: error: overlapping setpoints\n");
 			passed = 0;
 		}
 
-		/* apply changes only if checks pass */
+		/* apply changes only if checks pass. Values that already are
+		 * in the chip (at register resolution) are not written again.
+		 * The cache only takes a value once the chip has it, and if
+		 * one write fails, the ones before it are undone.
+		 */
 		if (passed) {
-			down(&data->update_lock);
-
-			if (new[0] != LM77_SC_NOTSET) {
-				data->temp_min = new[0];
-				lm77_write_value(client, LM77_REG_T_LOW, LM77_TEMP_TO_REG(new[0]));
-			}
-			if (new[1] != LM77_SC_NOTSET) {
-				data->temp_max = new[1];
-				lm77_write_value(client, LM77_REG_T_HIGH, LM77_TEMP_TO_REG(new[1]));
+			n = moved = failed = 0;
+			for (i = 0; i < LM77_LIMITS; i++)
+				old[i] = data->reg[chip->limit_regs[i]];
+			for (i = 0; i < LM77_LIMITS; i++) {
+				if (new[i] == LM77_SC_NOTSET || want[i] == old[i])
+					continue;
+				reg = chip->limit_regs[i];
+				val = want[i];
+				/* in guard band mode only the shadow has it */
+				if (lm77_guarded(data, reg)) {
+					lm77_set_reg(data, reg, val);
+					moved = 1;
+					continue;
+				}
+				if (lm77_write_value(client, reg, val) < 0) {
+					printk(KERN_WARNING "lm77: cannot write "
+					       "register 0x%02x\n", reg);
+					lm77_mark(data, reg, 0);
+					failed = 1;
+					break;
+				}
+				lm77_set_reg(data, reg, val);
+				regs[n] = reg;
+				idx[n++] = i;
 			}
-			if (new[2] != LM77_SC_NOTSET) {
-				data->temp_crit = new[2];
-				lm77_write_value(client, LM77_REG_T_CRIT, LM77_TEMP_TO_REG(new[2]));
+
+			if (failed) {
+				for (i = 0; i < n; i++) {
+					if (lm77_write_value(client, regs[i],
+					                     old[idx[i]]) < 0)
+						lm77_mark(data, regs[i], 0);
+					else
+						lm77_set_reg(data, regs[i],
+						             old[idx[i]]);
+				}
+				for (i = 0; i < LM77_LIMITS; i++)
+					if (lm77_guarded(data, chip->limit_regs[i]))
+						lm77_set_reg(data,
+						             chip->limit_regs[i],
+						             old[i]);
+				n = moved = 0;
 			}
-			if (new[3] != LM77_SC_NOTSET) {
-				data->temp_max = new[3];
-				lm77_write_value(client, LM77_REG_T_HYST, LM77_TEMP_TO_REG(new[3]));
+
+			/* a mismatch is reported and then cached as read */
+			if (verify_writes && n) {
+				lm77_read_block(client, regs, n, vals);
+				for (i = 0; i < n; i++) {
+					if (vals[i] >= 0 &&
+					    (vals[i] & ~chip->alarm_mask) ==
+					    want[idx[i]])
+						continue;
+					printk(KERN_WARNING "lm77: register 0x%02x "
+					       "did not take the new value\n",
+					       regs[i]);
+					if (vals[i] >= 0)
+						lm77_set_reg(data, regs[i],
+						             vals[i]);
+				}
 			}
 
-			printk(KERN_INFO "lm77: changes applied.\n");
-			
-			up(&data->update_lock);
+			if (data->guard && (n || moved))
+				lm77_guard_center(client);
+			if (failed) {
+				lm77_publish(data);
+				printk(KERN_NOTICE "lm77: changes not applied.\n");
+			} else if (n || moved) {
+				lm77_publish(data);
+				printk(KERN_INFO "lm77: changes applied.\n");
+			}
 		} else
 			printk(KERN_NOTICE "lm77: changes not applied.\n");
+
+		lm77_unlock(data);
 	}
 }
 
 void lm77_proc_alarms(struct i2c_client *client, int operation, int ctl_name,
 		 int *nrels_mag, long *results)
 {
-	struct lm77_data *data = client->data;
+	struct lm77_sample s;
 	
 	if (operation == SENSORS_PROC_REAL_INFO)
 		*nrels_mag = 0;
 	else if (operation == SENSORS_PROC_REAL_READ) {
-		lm77_update_client(client);
-		results[0] = (data->alarms & LM77_ALARM_LOW) ? 1 : 0;
-		results[1] = (data->alarms & LM77_ALARM_HIGH) ? 1 : 0;
-		results[2] = (data->alarms & LM77_ALARM_CRIT) ? 1 : 0;
+		lm77_get_sample(client, &s);
+		results[0] = (s.alarms & LM77_ALARM_LOW) ? 1 : 0;
+		results[1] = (s.alarms & LM77_ALARM_HIGH) ? 1 : 0;
+		results[2] = (s.alarms & LM77_ALARM_CRIT) ? 1 : 0;
+		*nrels_mag = 3;
+	}
+}
+
+/* update_interval: cache lifetime in ms, adaptive mode on/off and
+   (read-only) the lifetime currently in effect */
+void lm77_proc_interval(struct i2c_client *client, int operation,
+			int ctl_name, int *nrels_mag, long *results)
+{
+	struct lm77_data *data = client->data;
+
+	if (operation == SENSORS_PROC_REAL_INFO)
+		*nrels_mag = 0;
+	else if (operation == SENSORS_PROC_REAL_READ) {
+		results[0] = data->interval * 1000 / HZ;
+		results[1] = data->adaptive;
+		results[2] = data->cur_interval * 1000 / HZ;
+		*nrels_mag = 3;
+	} else if (operation == SENSORS_PROC_REAL_WRITE) {
+		if (!lm77_lock_live(data))
+			return;
+		if (*nrels_mag >= 1) {
+			data->interval = SENSORS_LIMIT(results[0],
+			                               LM77_MIN_INTERVAL_MS,
+			                               LM77_MAX_INTERVAL_MS)
+			                 * HZ / 1000;
+			if (data->interval < 1)
+				data->interval = 1;
+		}
+		if (*nrels_mag >= 2)
+			data->adaptive = results[1] ? 1 : 0;
+		data->cur_interval = data->interval;
+		data->scheduled = 0;
+		lm77_publish(data);
+		lm77_unlock(data);
+		wake_up_interruptible(&lm77_sampler_wait);
+	}
+}
+
+/* duty_cycle: 1 keeps the chip in shutdown between samples, 0 lets it
+   convert continuously. Each sample then takes LM77_CONV_MS, and alarms
+   are only noticed when a sample is taken. */
+void lm77_proc_duty(struct i2c_client *client, int operation,
+		    int ctl_name, int *nrels_mag, long *results)
+{
+	struct lm77_data *data = client->data;
+
+	if (operation == SENSORS_PROC_REAL_INFO)
+		*nrels_mag = 0;
+	else if (operation == SENSORS_PROC_REAL_READ) {
+		results[0] = data->duty;
+		*nrels_mag = 1;
+	} else if (operation == SENSORS_PROC_REAL_WRITE) {
+		if (*nrels_mag >= 1) {
+			if (!lm77_lock_live(data))
+				return;
+			if (results[0])
+				lm77_guard_set(client, 0);
+			/* duty_cycle only changes once the chip has it */
+			if (lm77_write_conf(client, results[0]
+			                    ? data->conf | LM77_CONF_SHUTDOWN
+			                    : data->conf & ~LM77_CONF_SHUTDOWN) < 0)
+				printk(KERN_WARNING "lm77: cannot write "
+				       "register 0x%02x\n", LM77_REG_CONF);
+			else
+				data->duty = results[0] ? 1 : 0;
+			lm77_publish(data);
+			lm77_unlock(data);
+		}
+	}
+}
+
+/* alarm_filter: fault queue of the chip on/off, and the number of
+   refreshes an alarm change must persist before it is reported */
+void lm77_proc_filter(struct i2c_client *client, int operation,
+		      int ctl_name, int *nrels_mag, long *results)
+{
+	struct lm77_data *data = client->data;
+
+	if (operation == SENSORS_PROC_REAL_INFO)
+		*nrels_mag = 0;
+	else if (operation == SENSORS_PROC_REAL_READ) {
+		results[0] = (data->conf & LM77_CONF_FAULTQ) ? 1 : 0;
+		results[1] = data->debounce;
+		*nrels_mag = 2;
+	} else if (operation == SENSORS_PROC_REAL_WRITE) {
+		if (!lm77_lock_live(data))
+			return;
+		/* The fault queue setting read back is data->conf, which
+		   only changes once the chip has it */
+		if (*nrels_mag >= 1 &&
+		    lm77_write_conf(client, results[0]
+		                    ? data->conf | LM77_CONF_FAULTQ
+		                    : data->conf & ~LM77_CONF_FAULTQ) < 0)
+			printk(KERN_WARNING "lm77: cannot write register "
+			       "0x%02x\n", LM77_REG_CONF);
+		if (*nrels_mag >= 2) {
+			data->debounce = SENSORS_LIMIT(results[1], 0,
+			                               LM77_MAX_DEBOUNCE);
+			data->alarm_count = 0;
+		}
+		lm77_publish(data);
+		lm77_unlock(data);
+	}
+}
+
+/* guard_band: width of the band in guard band mode, 0 for polling. The
+   mode needs INT to be wired and the chip to convert continuously. */
+void lm77_proc_guard(struct i2c_client *client, int operation,
+		     int ctl_name, int *nrels_mag, long *results)
+{
+	struct lm77_data *data = client->data;
+
+	if (operation == SENSORS_PROC_REAL_INFO)
+		*nrels_mag = lm77_mag();
+	else if (operation == SENSORS_PROC_REAL_READ) {
+		results[0] = lm77_out_tenths(data->guard);
+		*nrels_mag = 1;
+	} else if (operation == SENSORS_PROC_REAL_WRITE) {
+		if (*nrels_mag < 1)
+			return;
+		if (results[0] > 0 && (!data->irq || data->duty)) {
+			printk(KERN_NOTICE "lm77: guard band needs INT wired "
+			       "and duty_cycle off\n");
+			return;
+		}
+		if (!lm77_lock_live(data))
+			return;
+		lm77_guard_set(client, lm77_in(results[0]));
+		lm77_unlock(data);
+	}
+}
+
+/* Min, max and mean over the last minutes, and the trend from the oldest
+   to the newest bucket in there in tenths of a degree per minute. Buckets
+   without readings (or from before the window) are skipped. Returns the
+   number of buckets used. The caller must hold update_lock. */
+static int lm77_trend_window(struct lm77_data *data, int minutes,
+			     long *vals, long *slope)
+{
+	struct lm77_bucket *b, *first = NULL, *last = NULL;
+	unsigned long epoch = jiffies / (LM77_BUCKET_SECS * HZ);
+	long sum = 0;
+	int i, count = 0, used = 0;
+
+	for (i = 0; i < minutes * 60 / LM77_BUCKET_SECS; i++) {
+		b = &data->bucket[(epoch - i) % LM77_BUCKETS];
+		if (b->epoch != epoch - i || !b->count)
+			continue;
+		if (!used) {
+			vals[0] = b->min;
+			vals[1] = b->max;
+			last = b;
+		}
+		if (b->min < vals[0])
+			vals[0] = b->min;
+		if (b->max > vals[1])
+			vals[1] = b->max;
+		sum += b->sum;
+		count += b->count;
+		first = b;
+		used++;
+	}
+
+	if (!used) {
+		vals[0] = vals[1] = vals[2] = 0;
+		*slope = 0;
+		return 0;
+	}
+	vals[2] = sum / count;
+
+	if (first != last)
+		*slope = (last->sum / last->count - first->sum / first->count)
+		         * 60 / (long)((last->epoch - first->epoch)
+		                       * LM77_BUCKET_SECS);
+	else
+		*slope = 0;
+	return used;
+}
+
+/* temp_avg: the three moving averages, see ewma_tau
+   temp_win1, temp_win5, temp_win15: min, max and mean over 1, 5 and 15
+   minutes
+   temp_slope: trend over 5 and 15 minutes, in degrees per minute */
+void lm77_proc_trend(struct i2c_client *client, int operation,
+		     int ctl_name, int *nrels_mag, long *results)
+{
+	struct lm77_data *data = client->data;
+	struct lm77_sample s;
+	long dummy[3], slope5, slope15;
+	int i;
+
+	if (operation == SENSORS_PROC_REAL_INFO)
+		*nrels_mag = lm77_mag();
+	else if (operation == SENSORS_PROC_REAL_READ) {
+		/* The averages are published with the sample; the windows
+		   are worked out from the buckets, under the lock */
+		lm77_get_sample(client, &s);
+		if (ctl_name == LM77_SYSCTL_TEMP_AVG) {
+			for (i = 0; i < 3; i++)
+				results[i] = s.avg[i];
+			*nrels_mag = 3;
+		} else {
+			lm77_lock(data);
+			switch (ctl_name) {
+			case LM77_SYSCTL_TEMP_WIN1:
+				lm77_trend_window(data, 1, results, &slope5);
+				*nrels_mag = 3;
+				break;
+
+			case LM77_SYSCTL_TEMP_WIN5:
+				lm77_trend_window(data, 5, results, &slope5);
+				*nrels_mag = 3;
+				break;
+
+			case LM77_SYSCTL_TEMP_WIN15:
+				lm77_trend_window(data, 15, results, &slope15);
+				*nrels_mag = 3;
+				break;
+
+			case LM77_SYSCTL_TEMP_SLOPE:
+				lm77_trend_window(data, 5, dummy, &slope5);
+				lm77_trend_window(data, 15, dummy, &slope15);
+				results[0] = slope5;
+				results[1] = slope15;
+				*nrels_mag = 2;
+				break;
+			}
+			lm77_unlock(data);
+		}
+
+		for (i = 0; i < *nrels_mag; i++)
+			results[i] = lm77_out_tenths(results[i]);
+	}
+}
+
+/* temp_age: how old the current reading is, and how old the conversion
+   it came from is at most, both in milliseconds */
+void lm77_proc_age(struct i2c_client *client, int operation, int ctl_name,
+		   int *nrels_mag, long *results)
+{
+	struct lm77_sample s;
+	unsigned long now;
+
+	if (operation == SENSORS_PROC_REAL_INFO)
+		*nrels_mag = 0;
+	else if (operation == SENSORS_PROC_REAL_READ) {
+		lm77_get_sample(client, &s);
+		now = jiffies;
+		if (!s.valid)
+			results[0] = results[1] = -1;
+		else {
+			results[0] = (now - s.last_updated) * 1000 / HZ;
+			results[1] = (now - s.conv) * 1000 / HZ;
+		}
+		*nrels_mag = 2;
+	}
+}
+
+/* Seconds since an unread register was last read successfully, 0 if it
+   is fresh */
+static long lm77_stale_secs(struct lm77_data *data, u8 reg)
+{
+	if (!data->stale_since[reg])
+		return 0;
+	return (jiffies - data->stale_since[reg]) / HZ + 1;
+}
+
+/* slot: the character device slot of the client (-1 if it has none)
+   and the major number. The minors of the client are slot << 3 plus the
+   node, see LM77_NODE_*. A slot is given to the next client once its
+   client is detached. */
+void lm77_proc_slot(struct i2c_client *client, int operation, int ctl_name,
+		    int *nrels_mag, long *results)
+{
+	struct lm77_data *data = client->data;
+
+	if (operation == SENSORS_PROC_REAL_INFO)
+		*nrels_mag = 0;
+	else if (operation == SENSORS_PROC_REAL_READ) {
+		results[0] = data->slot;
+		results[1] = lm77_major;
+		*nrels_mag = 2;
+	}
+}
+
+/* status: failed refreshes in a row, and for how many seconds the
+   temperature and (the oldest of) the limits have been stale */
+void lm77_proc_status(struct i2c_client *client, int operation,
+		      int ctl_name, int *nrels_mag, long *results)
+{
+	struct lm77_data *data = client->data;
+	const u8 *regs = lm77_chip(data)->limit_regs;
+	long t;
+	int i;
+
+	if (operation == SENSORS_PROC_REAL_INFO)
+		*nrels_mag = 0;
+	else if (operation == SENSORS_PROC_REAL_READ) {
+		lm77_lock(data);
+		results[0] = data->errors;
+		results[1] = lm77_stale_secs(data, LM77_REG_TEMP);
+		results[2] = 0;
+		for (i = 0; i < LM77_LIMITS; i++)
+			if ((t = lm77_stale_secs(data, regs[i])) > results[2])
+				results[2] = t;
+		lm77_unlock(data);
 		*nrels_mag = 3;
 	}
 }
 
+#ifdef LM77_STATS
+void lm77_proc_stats_reset(struct i2c_client *client, int operation,
+			   int ctl_name, int *nrels_mag, long *results)
+{
+	struct lm77_data *data = client->data;
+
+	if (operation == SENSORS_PROC_REAL_INFO)
+		*nrels_mag = 0;
+	else if (operation == SENSORS_PROC_REAL_READ)
+		/* nothing to read */
+		*nrels_mag = 0;
+	else if (operation == SENSORS_PROC_REAL_WRITE) {
+		if ((*nrels_mag >= 1) && (results[0] == 1)) {
+			lm77_lock(data);
+			memset(data->stats, 0, sizeof(data->stats));
+			lm77_unlock(data);
+		}
+	}
+}
+#endif
+
 #ifdef DEBUG
 void lm77_proc_reset(struct i2c_client *client, int operation, int ctl_name,
 		 int *nrels_mag, long *results)
 {
+	struct lm77_data *data = client->data;
+
 	if (operation == SENSORS_PROC_REAL_INFO)
 		*nrels_mag = 0;
 	else if (operation == SENSORS_PROC_REAL_READ)
@@ -568,32 +3369,617 @@ void lm77_proc_reset(struct i2c_client *client, int operation, int ctl_name,
 			/* avoid using LM77_TEMP_TO_REG et al here, so that resetting
 			 * works even when the conversion is broken
 			*/
-			lm77_write_value(client, LM77_REG_CONF, LM77_DEFAULT_CONF);
+			if (!lm77_lock_live(data))
+				return;
+			lm77_guard_set(client, 0);
+			if (!lm77_write_conf(client, LM77_DEFAULT_CONF))
+				data->duty = 0;
 			lm77_write_value(client, LM77_REG_T_LOW, LM77_DEFAULT_T_LOW);
 			lm77_write_value(client, LM77_REG_T_HIGH, LM77_DEFAULT_T_HIGH);
 			lm77_write_value(client, LM77_REG_T_CRIT, LM77_DEFAULT_T_CRIT);
 			lm77_write_value(client, LM77_REG_T_HYST, LM77_DEFAULT_T_HYST);
 
+			lm77_update_limits(client);
+			lm77_publish(data);
+			lm77_unlock(data);
+
 			printk(KERN_NOTICE "lm77: registers reset to their default,\n");
 		}
 	}
 }
 #endif
 
+/* Module wide proc interface */
+
+/* Print a temperature in the same format as i2c_proc_real, magnitude 1,
+   or as plain millidegrees */
+static int lm77_sprint_temp(char *buf, struct lm77_data *data,
+			    const struct lm77_sample *s, u8 reg)
+{
+	long temp = lm77_out(data, s, reg);
+
+	if (millidegree)
+		return sprintf(buf, " %ld", temp);
+	return sprintf(buf, " %s%ld.%ld", temp < 0 ? "-" : "",
+	               (temp < 0 ? -temp : temp) / 10,
+	               (temp < 0 ? -temp : temp) % 10);
+}
+
+/* "sensors": one line per client with everything that the per-client
+   sysctl files would give, taken in one pass over the bus. Clients are
+   listed in attach order, so the ones on one adapter are refreshed back
+   to back. */
+static int lm77_read_proc_sensors(char *page, char **start, off_t off,
+				  int count, int *eof, void *unused)
+{
+	struct list_head *pos;
+	struct lm77_data *data;
+	struct lm77_sample s;
+	const u8 *regs;
+	int len;
+
+	len = sprintf(page, "# bus addr temp_min temp_max temp_input "
+	              "temp_crit temp_hyst alarms slot\n");
+
+	down(&lm77_clients_lock);
+	list_for_each(pos, &lm77_clients) {
+		data = list_entry(pos, struct lm77_data, list);
+		regs = lm77_chip(data)->limit_regs;
+		lm77_get_sample(&data->client, &s);
+
+		len += sprintf(page + len, "%d 0x%02x",
+		               i2c_adapter_id(data->client.adapter),
+		               data->client.addr);
+		len += lm77_sprint_temp(page + len, data, &s,
+		                        regs[LM77_LIM_MIN]);
+		len += lm77_sprint_temp(page + len, data, &s,
+		                        regs[LM77_LIM_MAX]);
+		len += lm77_sprint_temp(page + len, data, &s, LM77_REG_TEMP);
+		len += lm77_sprint_temp(page + len, data, &s,
+		                        regs[LM77_LIM_CRIT]);
+		len += lm77_sprint_temp(page + len, data, &s,
+		                        regs[LM77_LIM_HYST]);
+		len += sprintf(page + len, " %d %d %d %d\n",
+		               (s.alarms & LM77_ALARM_LOW) ? 1 : 0,
+		               (s.alarms & LM77_ALARM_HIGH) ? 1 : 0,
+		               (s.alarms & LM77_ALARM_CRIT) ? 1 : 0,
+		               data->slot);
+	}
+	up(&lm77_clients_lock);
+
+	if (len <= off + count)
+		*eof = 1;
+	*start = page + off;
+	len -= off;
+	if (len > count)
+		len = count;
+	if (len < 0)
+		len = 0;
+	return len;
+}
+
+#ifdef LM77_STATS
+/* "stats": the performance counters of all clients. Latency buckets are
+   printed as log2(cycles):count, empty buckets are left out. */
+static int lm77_read_proc_stats(char *page, char **start, off_t off,
+				int count, int *eof, void *unused)
+{
+	struct list_head *pos;
+	struct lm77_data *data;
+	struct lm77_stats st;
+	int i, len = 0;
+
+	down(&lm77_clients_lock);
+	list_for_each(pos, &lm77_clients) {
+		/* leave room for one more client */
+		if (len > PAGE_SIZE - 512) {
+			len += sprintf(page + len, "...\n");
+			break;
+		}
+
+		data = list_entry(pos, struct lm77_data, list);
+		lm77_stat_sum(data, &st);
+
+		len += sprintf(page + len, "%d 0x%02x reads %lu writes %lu "
+		               "errors %lu hits %lu misses %lu "
+		               "waits %lu repeats %lu contended %lu "
+		               "retries %lu lock_wait %llu\n latency",
+		               i2c_adapter_id(data->client.adapter),
+		               data->client.addr, st.reads, st.writes,
+		               st.errors, st.hits, st.misses,
+		               st.waits, st.repeats, st.contended, st.retries,
+		               (unsigned long long)st.lock_wait);
+		for (i = 0; i < LM77_STATS_BUCKETS; i++)
+			if (st.latency[i])
+				len += sprintf(page + len, " %d:%lu", i,
+				               st.latency[i]);
+		len += sprintf(page + len, "\n");
+	}
+	up(&lm77_clients_lock);
+
+	if (len <= off + count)
+		*eof = 1;
+	*start = page + off;
+	len -= off;
+	if (len > count)
+		len = count;
+	if (len < 0)
+		len = 0;
+	return len;
+}
+#endif
+
+/* "trace": the bus trace, oldest first, one transfer per line: jiffies
+   when it finished, bus, address, operation, register, value (negative
+   for an error) and duration in get_cycles() units. The ring keeps
+   moving while tracing is on; write 0 first for a consistent dump. */
+static int lm77_read_proc_trace(char *page, char **start, off_t off,
+				int count, int *eof, void *unused)
+{
+	struct lm77_trace t;
+	unsigned int head, first, n, i = off / LM77_TRACE_LINE;
+	int skip = off % LM77_TRACE_LINE, len = 0;
+
+	spin_lock(&lm77_trace_lock);
+	head = lm77_trace_head;
+	spin_unlock(&lm77_trace_lock);
+	n = min(head, (unsigned int)LM77_TRACE);
+	first = head - n;
+
+	for (; i <= n && len - skip < count
+	       && len + LM77_TRACE_LINE < PAGE_SIZE; i++) {
+		if (!i) {
+			len += sprintf(page + len, "%-*s\n",
+			               LM77_TRACE_LINE - 1,
+			               "# jiffies bus addr op reg value cycles");
+			continue;
+		}
+		spin_lock(&lm77_trace_lock);
+		t = lm77_trace_ring[(first + i - 1) & (LM77_TRACE - 1)];
+		spin_unlock(&lm77_trace_lock);
+		len += sprintf(page + len, "%10u %3u 0x%02x %c 0x%02x %6d %10u\n",
+		               (u32)t.jiffies, t.bus, t.addr, t.op, t.reg,
+		               t.value, (u32)min(t.cycles, 4294967295UL));
+	}
+	if (i > n)
+		*eof = 1;
+
+	*start = page + skip;
+	len -= skip;
+	if (len > count)
+		len = count;
+	if (len < 0)
+		len = 0;
+	return len;
+}
+
+static int lm77_write_proc_trace(struct file *file, const char *buffer,
+				 unsigned long count, void *unused)
+{
+	char c;
+
+	if (!count)
+		return 0;
+	if (get_user(c, buffer))
+		return -EFAULT;
+
+	if (c == '1') {
+		spin_lock(&lm77_trace_lock);
+		lm77_trace_head = 0;
+		spin_unlock(&lm77_trace_lock);
+		trace = 1;
+	} else if (c == '0')
+		trace = 0;
+	else
+		return -EINVAL;
+	return count;
+}
+
+static void lm77_proc_init(void)
+{
+	struct proc_dir_entry *e;
+
+	if (!(lm77_proc_dir = proc_mkdir("driver/lm77", NULL))) {
+		printk(KERN_WARNING "lm77.o: cannot create /proc/driver/lm77\n");
+		return;
+	}
+	create_proc_read_entry("sensors", 0444, lm77_proc_dir,
+	                       lm77_read_proc_sensors, NULL);
+	if ((e = create_proc_entry("trace", 0644, lm77_proc_dir))) {
+		e->read_proc = lm77_read_proc_trace;
+		e->write_proc = lm77_write_proc_trace;
+	}
+#ifdef LM77_STATS
+	create_proc_read_entry("stats", 0444, lm77_proc_dir,
+	                       lm77_read_proc_stats, NULL);
+#endif
+}
+
+static void lm77_proc_exit(void)
+{
+	if (!lm77_proc_dir)
+		return;
+	remove_proc_entry("sensors", lm77_proc_dir);
+	remove_proc_entry("trace", lm77_proc_dir);
+#ifdef LM77_STATS
+	remove_proc_entry("stats", lm77_proc_dir);
+#endif
+	remove_proc_entry("driver/lm77", NULL);
+}
+
+/* Character device interface */
+
+static int lm77_open(struct inode *inode, struct file *file)
+{
+	int minor = MINOR(inode->i_rdev);
+	int slot = minor >> LM77_MINOR_SHIFT;
+	int node = minor & LM77_NODE_MASK;
+	struct lm77_data *data;
+	struct lm77_file *f;
+	int err;
+
+	if (node != LM77_NODE_ALARMS && node != LM77_NODE_HISTORY &&
+	    node != LM77_NODE_EVENTS && node != LM77_NODE_CHANGES)
+		return -ENXIO;
+	if ((file->f_flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	if (!(f = kmalloc(sizeof(struct lm77_file), GFP_KERNEL)))
+		return -ENOMEM;
+
+	down(&lm77_clients_lock);
+	if (slot >= LM77_MAX_CLIENTS || !(data = lm77_slots[slot])) {
+		up(&lm77_clients_lock);
+		kfree(f);
+		return -ENODEV;
+	}
+	data->users++;
+	up(&lm77_clients_lock);
+
+	/* the first read returns the current state right away; events are
+	   only those that happen from now on */
+	f->data = data;
+	f->node = node;
+	f->alarm_gen = data->alarm_gen - 1;
+	f->event_pos = data->event_head;
+	f->buf = NULL;
+	f->len = 0;
+	file->private_data = f;
+
+	if (node == LM77_NODE_CHANGES) {
+		if ((err = lm77_change_copy(data, f))) {
+			lm77_put(data);
+			kfree(f);
+			return err;
+		}
+	}
+	return 0;
+}
+
+/* Drop a reference taken by lm77_open() or a mapping */
+static void lm77_put(struct lm77_data *data)
+{
+	int last;
+
+	down(&lm77_clients_lock);
+	last = !--data->users && data->dead;
+	up(&lm77_clients_lock);
+
+	if (last)
+		lm77_free_data(data);
+}
+
+static int lm77_fasync(int fd, struct file *file, int on)
+{
+	struct lm77_file *f = file->private_data;
+
+	if (f->node != LM77_NODE_EVENTS)
+		return -EINVAL;
+	return fasync_helper(fd, file, on, &f->data->event_fasync);
+}
+
+static int lm77_release(struct inode *inode, struct file *file)
+{
+	struct lm77_file *f = file->private_data;
+
+	if (f->node == LM77_NODE_EVENTS)
+		lm77_fasync(-1, file, 0);
+	if (f->buf)
+		kfree(f->buf);
+	lm77_put(f->data);
+	kfree(f);
+	return 0;
+}
+
+static ssize_t lm77_read_alarms(struct file *file, char *buf, size_t count)
+{
+	struct lm77_file *f = file->private_data;
+	struct lm77_data *data = f->data;
+	struct lm77_sample s;
+	unsigned int gen;
+
+	if (count < 1)
+		return -EINVAL;
+
+	for (;;) {
+		if (data->dead)
+			return -ENODEV;
+		gen = data->alarm_gen;
+		smp_rmb();
+		if (gen != f->alarm_gen)
+			break;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(data->alarm_wait,
+		                             data->alarm_gen != f->alarm_gen
+		                             || data->dead))
+			return -ERESTARTSYS;
+	}
+
+	lm77_read_snapshot(data, &s);
+	if (put_user(s.alarms, buf))
+		return -EFAULT;
+	f->alarm_gen = gen;
+	return 1;
+}
+
+/* Return as many whole events as fit. A reader that fell more than
+   LM77_EVENTS behind skips to the oldest event still there. */
+static ssize_t lm77_read_events(struct file *file, char *buf, size_t count)
+{
+	struct lm77_file *f = file->private_data;
+	struct lm77_data *data = f->data;
+	struct lm77_event e;
+	ssize_t done = 0;
+
+	if (count < sizeof(struct lm77_event))
+		return -EINVAL;
+
+	for (;;) {
+		if (data->dead)
+			return -ENODEV;
+		if (data->event_head != f->event_pos)
+			break;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(data->event_wait,
+		                             data->event_head != f->event_pos
+		                             || data->dead))
+			return -ERESTARTSYS;
+	}
+
+	while (count - done >= sizeof(struct lm77_event)) {
+		spin_lock(&data->event_lock);
+		if (data->event_head == f->event_pos) {
+			spin_unlock(&data->event_lock);
+			break;
+		}
+		if (data->event_head - f->event_pos > LM77_EVENTS)
+			f->event_pos = data->event_head - LM77_EVENTS;
+		e = data->events[f->event_pos % LM77_EVENTS];
+		spin_unlock(&data->event_lock);
+
+		if (copy_to_user(buf + done, &e, sizeof(e)))
+			return done ? done : -EFAULT;
+		f->event_pos++;
+		done += sizeof(e);
+	}
+	return done;
+}
+
+static ssize_t lm77_read_changes(struct file *file, char *buf, size_t count,
+				 loff_t *ppos)
+{
+	struct lm77_file *f = file->private_data;
+
+	if (*ppos >= f->len)
+		return 0;
+	if (count > f->len - *ppos)
+		count = f->len - *ppos;
+	if (copy_to_user(buf, f->buf + *ppos, count))
+		return -EFAULT;
+	*ppos += count;
+	return count;
+}
+
+static ssize_t lm77_read(struct file *file, char *buf, size_t count,
+			 loff_t *ppos)
+{
+	struct lm77_file *f = file->private_data;
+
+	switch (f->node) {
+	case LM77_NODE_ALARMS:
+		return lm77_read_alarms(file, buf, count);
+	case LM77_NODE_EVENTS:
+		return lm77_read_events(file, buf, count);
+	case LM77_NODE_CHANGES:
+		return lm77_read_changes(file, buf, count, ppos);
+	}
+	return -EINVAL;
+}
+
+static unsigned int lm77_poll(struct file *file, poll_table *wait)
+{
+	struct lm77_file *f = file->private_data;
+	struct lm77_data *data = f->data;
+
+	if (f->node == LM77_NODE_EVENTS) {
+		poll_wait(file, &data->event_wait, wait);
+		if (data->dead)
+			return POLLERR;
+		if (data->event_head != f->event_pos)
+			return POLLIN | POLLRDNORM;
+		return 0;
+	}
+
+	if (f->node != LM77_NODE_ALARMS)
+		return POLLERR;
+
+	poll_wait(file, &data->alarm_wait, wait);
+	if (data->dead)
+		return POLLERR;
+	if (data->alarm_gen != f->alarm_gen)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+/* LM77_IOC_SNAPSHOT works on every node. The sample is refreshed first if
+   it is stale. No list lock is taken: the reference of the open file
+   keeps data around after a detach, and lm77_update_client() checks dead
+   under update_lock before it touches the bus, so a detached client only
+   gives -ENODEV. */
+static int lm77_ioctl(struct inode *inode, struct file *file,
+		      unsigned int cmd, unsigned long arg)
+{
+	struct lm77_file *f = file->private_data;
+	struct lm77_data *data = f->data;
+	const struct lm77_chip *chip = lm77_chip(data);
+	struct lm77_sample s;
+	struct lm77_snapshot snap;
+
+	if (cmd != LM77_IOC_SNAPSHOT)
+		return -ENOTTY;
+
+	lm77_get_sample(&data->client, &s);
+	if (data->dead)
+		return -ENODEV;
+
+	memset(&snap, 0, sizeof(snap));
+	snap.jiffies = s.last_updated;
+	snap.now = jiffies;
+	snap.hz = HZ;
+	snap.temp_input = chip->from_reg(s.reg[LM77_REG_TEMP]);
+	snap.temp_min = chip->from_reg(s.reg[chip->limit_regs[LM77_LIM_MIN]]);
+	snap.temp_max = chip->from_reg(s.reg[chip->limit_regs[LM77_LIM_MAX]]);
+	snap.temp_crit = chip->from_reg(s.reg[chip->limit_regs[LM77_LIM_CRIT]]);
+	snap.temp_hyst = chip->from_reg(s.reg[chip->limit_regs[LM77_LIM_HYST]]);
+	/* nregs is at most LM77_NUM_REGS, which is what user space gets */
+	memcpy(snap.reg, s.reg, chip->nregs * sizeof(*snap.reg));
+	snap.alarms = s.alarms;
+	snap.valid = s.valid;
+
+	if (copy_to_user((void *)arg, &snap, sizeof(snap)))
+		return -EFAULT;
+	return 0;
+}
+
+/* A mapping holds a reference of its own, so that the pages stay around
+   even when the client is detached while user space still looks at them */
+static void lm77_vm_open(struct vm_area_struct *vma)
+{
+	struct lm77_data *data = vma->vm_private_data;
+
+	down(&lm77_clients_lock);
+	data->users++;
+	up(&lm77_clients_lock);
+}
+
+static void lm77_vm_close(struct vm_area_struct *vma)
+{
+	lm77_put(vma->vm_private_data);
+}
+
+static struct vm_operations_struct lm77_vm_ops = {
+	.open		= lm77_vm_open,
+	.close		= lm77_vm_close,
+};
+
+static int lm77_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct lm77_file *f = file->private_data;
+	struct lm77_data *data = f->data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (f->node != LM77_NODE_HISTORY || !data->history)
+		return -ENODEV;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (vma->vm_pgoff || size > (PAGE_SIZE << data->history_order))
+		return -EINVAL;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_RESERVED;
+	if (remap_page_range(vma->vm_start, virt_to_phys(data->history), size,
+	                     vma->vm_page_prot))
+		return -EAGAIN;
+
+	vma->vm_ops = &lm77_vm_ops;
+	vma->vm_private_data = data;
+	lm77_vm_open(vma);
+	return 0;
+}
+
+static struct file_operations lm77_fops = {
+	.owner		= THIS_MODULE,
+	.llseek		= no_llseek,
+	.read		= lm77_read,
+	.poll		= lm77_poll,
+	.ioctl		= lm77_ioctl,
+	.mmap		= lm77_mmap,
+	.open		= lm77_open,
+	.release	= lm77_release,
+	.fasync		= lm77_fasync,
+};
+
 static int __init sm_lm77_init(void)
 {
+	int err;
+
 #ifdef DEBUG
 	printk(KERN_INFO "lm77.o version %s (%s+debug)\n", LM_VERSION, LM_DATE);
 #else
 	printk(KERN_INFO "lm77.o version %s (%s)\n", LM_VERSION, LM_DATE);
 #endif
 	printk(KERN_INFO "lm77.o $Id$\n");
-	return i2c_add_driver(&lm77_driver);
+
+	if ((err = register_chrdev(lm77_major, "lm77", &lm77_fops)) < 0) {
+		printk(KERN_ERR "lm77.o: cannot register major %d\n",
+		       lm77_major);
+		return err;
+	}
+	if (!lm77_major)
+		lm77_major = err;
+
+	if (sample_interval > 0) {
+		lm77_sampler_pid = kernel_thread(lm77_sampler, NULL,
+		                                 CLONE_FS | CLONE_FILES |
+		                                 CLONE_SIGHAND);
+		if (lm77_sampler_pid < 0) {
+			printk(KERN_ERR "lm77.o: cannot start sampler thread\n");
+			unregister_chrdev(lm77_major, "lm77");
+			return lm77_sampler_pid;
+		}
+	}
+
+	if (async_probe) {
+		lm77_prober_pid = kernel_thread(lm77_prober, NULL,
+		                                CLONE_FS | CLONE_FILES |
+		                                CLONE_SIGHAND);
+		if (lm77_prober_pid < 0) {
+			printk(KERN_WARNING "lm77.o: cannot start probe thread, "
+			       "probing synchronously\n");
+			lm77_prober_pid = 0;
+		}
+	}
+
+	if ((err = i2c_add_driver(&lm77_driver))) {
+		lm77_stop_prober();
+		lm77_stop_sampler();
+		unregister_chrdev(lm77_major, "lm77");
+		return err;
+	}
+
+	lm77_proc_init();
+	return 0;
 }
 
 static void __exit sm_lm77_exit(void)
 {
+	lm77_proc_exit();
+	lm77_stop_prober();
+	lm77_stop_sampler();
 	i2c_del_driver(&lm77_driver);
+	unregister_chrdev(lm77_major, "lm77");
 }
 
 MODULE_AUTHOR("Michael Renzmann <mrenzmann@otaku42.de>");
@@ -22,10 +22,16 @@
 
 /*
     This file contains common code for encoding/decoding LM77 type
-    temperature readings.
+    temperature readings, and the structures of the device interface.
+    Only the latter are visible to userspace.
 */
 
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#ifdef __KERNEL__
 #include <linux/i2c-proc.h>
+#endif
 
 /* straight from the datasheet */
 #define LM77_TEMP_MIN (-550)
@@ -33,15 +39,136 @@
 
 /* In the temperature registers the lowest 3 bits are not part of the
  * temperature values (either unused or representing alarm status,
- * depending on the register). 
+ * depending on the register). The rest is a two's complement number of
+ * 0.5 deg celsius steps, which an arithmetic shift gets exactly, alarm
+ * bits or not.
  */
+#define LM77_TEMP_SHIFT 3
+
+#ifdef __KERNEL__
+/* In tenths of a degree celsius */
 static inline s16 LM77_TEMP_TO_REG(int temp)
 {
 	int ntemp = SENSORS_LIMIT(temp, LM77_TEMP_MIN, LM77_TEMP_MAX);
-	return (ntemp / 5) * 8;
+	return (ntemp / 5) << LM77_TEMP_SHIFT;
 }
 
 static inline int LM77_TEMP_FROM_REG(s16 reg)
 {
-        return (reg / 8) * 5;
+	return (reg >> LM77_TEMP_SHIFT) * 5;
+}
+
+/* In millidegrees celsius, as in the hwmon sysfs interface of 2.6 */
+static inline s16 LM77_TEMP_TO_REG_MC(long temp)
+{
+	long ntemp = SENSORS_LIMIT(temp, LM77_TEMP_MIN * 100L,
+	                           LM77_TEMP_MAX * 100L);
+	return (ntemp / 500) << LM77_TEMP_SHIFT;
+}
+
+static inline long LM77_TEMP_FROM_REG_MC(s16 reg)
+{
+	return (reg >> LM77_TEMP_SHIFT) * 500L;
 }
+#endif /* __KERNEL__ */
+
+/* Sample history, mapped read-only through the history device node of a
+ * client. head counts the samples ever written; sample n is stored in
+ * entry[n & (size - 1)]. The driver writes the entry before it increments
+ * head. A reader should therefore read head first and then the entries
+ * it wants. It must then read head again, and discard any entry that
+ * might have been overwritten in the meantime. A reading is only stored
+ * when the register changed, so the entries mark the changes; how old
+ * the latest reading is can be found in the temp_age sysctl file.
+ */
+#define LM77_HISTORY_MAGIC 0x4c4d3737	/* "LM77" */
+
+struct lm77_history_entry {
+	__u32 jiffies;			/* Time of the reading */
+	__s16 temp;			/* Raw LM77_REG_TEMP, incl. alarm bits */
+	__u16 reserved;
+};
+
+struct lm77_history {
+	__u32 magic;
+	__u32 size;			/* Number of entries, a power of two */
+	__u32 hz;			/* jiffies per second */
+	volatile __u32 head;
+	struct lm77_history_entry entry[0];
+};
+
+/* Everything the driver knows about one sensor, as returned by the
+ * LM77_IOC_SNAPSHOT ioctl on any of its device nodes. All fields are
+ * taken from the same published sample. Temperatures are in tenths of a
+ * degree celsius, whatever the millidegree parameter says. reg[] holds
+ * the register contents these values were read from, indexed by register
+ * number; the alarm bits in reg[0] are as read, before debouncing.
+ */
+#define LM77_SNAPSHOT_REGS 6
+
+struct lm77_snapshot {
+	__u32 jiffies;			/* Time of the reading */
+	__u32 now;			/* Time of the ioctl */
+	__u32 hz;			/* jiffies per second */
+	__s32 temp_input;
+	__s32 temp_min;
+	__s32 temp_max;
+	__s32 temp_crit;
+	__s32 temp_hyst;
+	__u16 reg[LM77_SNAPSHOT_REGS];
+	__u8 alarms;
+	__u8 valid;
+	__u16 reserved;
+};
+
+#define LM77_IOC_MAGIC 'L'
+#define LM77_IOC_SNAPSHOT _IOR(LM77_IOC_MAGIC, 0, struct lm77_snapshot)
+
+/* Records read from the event device node of a client. seq numbers the
+ * events of a client; a gap means the reader fell behind and lost some.
+ */
+#define LM77_EVENT_ALARM 1		/* Alarm bits changed */
+#define LM77_EVENT_TEMP 2		/* Temperature moved by event_delta */
+
+struct lm77_event {
+	__u32 seq;
+	__u32 jiffies;			/* Time of the reading */
+	__u16 type;			/* LM77_EVENT_* */
+	__u8 alarms;			/* Alarm bits after the reading */
+	__u8 changed;			/* Alarm bits that changed */
+	__s32 temp;			/* In tenths of a degree celsius */
+};
+
+/* Change log, read from the changes device node of a client. The stream
+ * starts with struct lm77_changes. Then come its blocks, oldest first,
+ * each block_size bytes long. A block is a sequence of records. It ends
+ * at the block size, or at a 0xff byte where the next record would
+ * start. Inside a record 0xff is an ordinary byte, since keyframe
+ * payloads and dt bytes can take that value. Every block starts with a
+ * keyframe, so the blocks can be decoded on their own. Records:
+ *
+ * 0x80 t0 t1 t2 t3 r0 r1	keyframe: jiffies and raw LM77_REG_TEMP,
+ *				both little endian
+ * 0x00-0x3f dt			temperature changed by the low six bits
+ *				(signed) times 0.5 deg celsius; the
+ *				temperature is r >> 3, an arithmetic
+ *				shift of the raw register
+ * 0x40-0x47 dt			alarm bits are now the low three bits
+ * 0xff				end of block (only where a record starts)
+ *
+ * dt is the time since the previous record, in jiffies. It is stored
+ * seven bits per byte, least significant first, and bit 7 is set on all
+ * but the last byte.
+ */
+#define LM77_CHANGES_MAGIC 0x4c4d4343	/* "LMCC" */
+
+#define LM77_CHANGE_KEY 0x80
+#define LM77_CHANGE_ALARMS 0x40
+#define LM77_CHANGE_END 0xff
+
+struct lm77_changes {
+	__u32 magic;
+	__u32 hz;			/* jiffies per second */
+	__u16 block_size;
+	__u16 blocks;			/* Number of blocks that follow */
+};
@@ -0,0 +1,419 @@
+/*
+    lm77-stub.c - Simulated LM77 on a fake I2C/SMBus adapter, for
+                  measuring lm77.o without real hardware
+    Copyright (c) 2005 - 2007  Michael Renzmann <mrenzmann@otaku42.de>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+    The adapter answers at one address only and emulates what lm77.o
+    relies on: the register file repeats every 8 addresses, registers
+    0x06 and 0x07 return the last value read, temperature registers are
+    high-byte first and the status bits in the temperature register
+    follow the limits with hysteresis. Conversions, the fault queue, the
+    INT and T_CRIT_A pins and shutdown mode are not emulated; the
+    temperature only changes when it is written to the control file.
+
+    The adapter does both SMBus and plain I2C transfers, so lm77.o takes
+    its I2C backend unless it is loaded with smbus_only=1. For plain I2C
+    the chip has a pointer register like the real one: a write message
+    sets it with its first byte and writes the register with the rest, a
+    read message reads the register it points at. SMBus transfers with a
+    command set the pointer as well. One i2c_transfer() counts as one
+    transfer, however many messages it carries.
+
+    /proc/driver/lm77-stub shows the settings and the transfer counters.
+    Write one of these to it:
+
+      temp <millidegrees>   set the measured temperature
+      latency <us>          busy-wait that long in every transfer
+      fail_every <n>        fail every n-th transfer with -EIO (0 = never)
+      reset                 clear the counters
+*/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/i2c.h>
+#include <linux/delay.h>
+#include <linux/spinlock.h>
+#include <linux/proc_fs.h>
+#include <linux/ctype.h>
+#include <asm/uaccess.h>
+
+#define STUB_REG_TEMP 0x00
+#define STUB_REG_CONF 0x01
+#define STUB_REG_T_HYST 0x02
+#define STUB_REG_T_CRIT 0x03
+#define STUB_REG_T_LOW 0x04
+#define STUB_REG_T_HIGH 0x05
+#define STUB_REG_LAST 0x06		/* 0x06 and 0x07 */
+
+#define STUB_ALARM_LOW 0x1
+#define STUB_ALARM_HIGH 0x2
+#define STUB_ALARM_CRIT 0x4
+
+/* Register contents are 0.5 deg steps in bits 3 and up */
+#define STUB_TEMP_TO_REG(mc)	((u16)(((mc) < 0 ? ((mc) - 250) / 500 \
+				                 : ((mc) + 250) / 500) * 8))
+#define STUB_TEMP(reg)		((s16)(reg) >> 3)
+
+static int addr = 0x48;
+MODULE_PARM(addr, "i");
+MODULE_PARM_DESC(addr, "Address of the simulated LM77 (default 0x48)");
+
+static int temp = 25000;
+MODULE_PARM(temp, "i");
+MODULE_PARM_DESC(temp, "Initial temperature in millidegrees celsius");
+
+static int latency = 0;
+MODULE_PARM(latency, "i");
+MODULE_PARM_DESC(latency, "Time every transfer takes, in microseconds");
+
+static int fail_every = 0;
+MODULE_PARM(fail_every, "i");
+MODULE_PARM_DESC(fail_every, "Fail every n-th transfer (0 = never)");
+
+/* The chip. reg[] is what the LM77 sends, i.e. before the byte swap of
+   the SMBus word transfers. */
+static struct stub_chip {
+	spinlock_t lock;
+	u16 reg[STUB_REG_LAST];
+	u16 last;		/* Last value read, for 0x06 and 0x07 */
+	u8 pointer;		/* Pointer register */
+	unsigned long xfers, reads, writes, quick, failed, nak;
+	unsigned long i2c, pointer_writes;	/* Plain I2C transfers, and
+						   messages that only set
+						   the pointer */
+} stub_chip = {
+	.lock	= SPIN_LOCK_UNLOCKED,
+	.reg	= {
+		[STUB_REG_T_HYST]	= 0x20,		/* Power-up defaults */
+		[STUB_REG_T_CRIT]	= 0x500,
+		[STUB_REG_T_LOW]	= 0xa0,
+		[STUB_REG_T_HIGH]	= 0x400,
+	},
+};
+
+/* Update the status bits in the temperature register the way the chip
+   does after a conversion: an alarm is raised when the temperature
+   crosses its limit and only goes away T_HYST on the other side */
+static void stub_convert(struct stub_chip *c)
+{
+	int t = STUB_TEMP(c->reg[STUB_REG_TEMP]);
+	int hyst = STUB_TEMP(c->reg[STUB_REG_T_HYST]);
+	int alarms = c->reg[STUB_REG_TEMP] & 0x7;
+
+	if (t > STUB_TEMP(c->reg[STUB_REG_T_CRIT]))
+		alarms |= STUB_ALARM_CRIT;
+	else if (t < STUB_TEMP(c->reg[STUB_REG_T_CRIT]) - hyst)
+		alarms &= ~STUB_ALARM_CRIT;
+
+	if (t > STUB_TEMP(c->reg[STUB_REG_T_HIGH]))
+		alarms |= STUB_ALARM_HIGH;
+	else if (t < STUB_TEMP(c->reg[STUB_REG_T_HIGH]) - hyst)
+		alarms &= ~STUB_ALARM_HIGH;
+
+	if (t < STUB_TEMP(c->reg[STUB_REG_T_LOW]))
+		alarms |= STUB_ALARM_LOW;
+	else if (t > STUB_TEMP(c->reg[STUB_REG_T_LOW]) + hyst)
+		alarms &= ~STUB_ALARM_LOW;
+
+	c->reg[STUB_REG_TEMP] = (c->reg[STUB_REG_TEMP] & ~0x7) | alarms;
+}
+
+static void stub_set_temp(struct stub_chip *c, long mc)
+{
+	c->reg[STUB_REG_TEMP] = STUB_TEMP_TO_REG(mc)
+	                        | (c->reg[STUB_REG_TEMP] & 0x7);
+	stub_convert(c);
+}
+
+static void stub_delay(int us)
+{
+	for (; us > 1000; us -= 1000)
+		udelay(1000);
+	if (us > 0)
+		udelay(us);
+}
+
+/* Count a transfer and decide whether it gets through. Called with the
+   lock held, which it drops when the transfer fails. */
+static int stub_begin(struct stub_chip *c, u16 address)
+{
+	int fail;
+
+	c->xfers++;
+	fail = fail_every > 0 && !(c->xfers % fail_every);
+	if (address != addr) {
+		c->nak++;
+		spin_unlock(&c->lock);
+		return -ENXIO;
+	}
+	if (fail) {
+		c->failed++;
+		spin_unlock(&c->lock);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void stub_write_reg(struct stub_chip *c, int reg, u16 val)
+{
+	c->writes++;
+	/* Temperature and the last-read registers are read-only, the
+	   status bits cannot be written */
+	if (reg == STUB_REG_CONF)
+		c->reg[reg] = val & 0x1f;
+	else if (reg > STUB_REG_CONF && reg < STUB_REG_LAST)
+		c->reg[reg] = val & ~0x7;
+	stub_convert(c);
+}
+
+static u16 stub_read_reg(struct stub_chip *c, int reg)
+{
+	c->reads++;
+	if (reg < STUB_REG_LAST)
+		c->last = c->reg[reg];
+	return c->last;
+}
+
+static s32 stub_xfer(struct i2c_adapter *adap, u16 address,
+		     unsigned short flags, char read_write, u8 command,
+		     int size, union i2c_smbus_data *data)
+{
+	struct stub_chip *c = &stub_chip;
+	int reg = command & 0x7;	/* Mirrored every 8 addresses */
+	int err;
+	u16 val;
+
+	stub_delay(latency);
+
+	spin_lock(&c->lock);
+	if ((err = stub_begin(c, address)))
+		return err;
+
+	switch (size) {
+	case I2C_SMBUS_QUICK:
+		c->quick++;
+		break;
+
+	case I2C_SMBUS_BYTE_DATA:
+	case I2C_SMBUS_WORD_DATA:
+		c->pointer = reg;
+		if (read_write == I2C_SMBUS_WRITE) {
+			stub_write_reg(c, reg, size == I2C_SMBUS_BYTE_DATA
+			                       ? data->byte
+			                       : swab16(data->word));
+			break;
+		}
+
+		val = stub_read_reg(c, reg);
+		/* A byte read gets the first byte the chip sends, which is
+		   the high byte of a word register */
+		if (size == I2C_SMBUS_BYTE_DATA)
+			data->byte = reg == STUB_REG_CONF ? val & 0xff
+			             : val >> 8;
+		else
+			data->word = swab16(val);
+		break;
+
+	default:
+		spin_unlock(&c->lock);
+		return -EINVAL;
+	}
+
+	spin_unlock(&c->lock);
+	return 0;
+}
+
+/* Plain I2C: the messages go to the chip in order, each write through the
+   pointer register. The chip sends a word register high byte first and
+   the configuration register as a single byte; whatever is clocked out
+   after that reads as 0xff, the bus idling high. */
+static int stub_master_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs,
+			    int num)
+{
+	struct stub_chip *c = &stub_chip;
+	struct i2c_msg *m;
+	int i, j, err, reg, len;
+	u16 val;
+
+	stub_delay(latency);
+
+	spin_lock(&c->lock);
+	for (i = 0; i < num; i++)
+		if (msgs[i].addr != addr)
+			break;
+	if ((err = stub_begin(c, i < num ? msgs[i].addr : addr)))
+		return err;
+	c->i2c++;
+
+	for (i = 0; i < num; i++) {
+		m = &msgs[i];
+		if (!(m->flags & I2C_M_RD)) {
+			if (!m->len)
+				continue;
+			c->pointer = m->buf[0] & 0x7;
+			reg = c->pointer;
+			if (m->len == 1)
+				c->pointer_writes++;
+			else if (reg == STUB_REG_CONF)
+				stub_write_reg(c, reg, m->buf[1]);
+			else if (m->len >= 3)
+				stub_write_reg(c, reg, (m->buf[1] << 8)
+				                       | m->buf[2]);
+			continue;
+		}
+
+		reg = c->pointer;
+		val = stub_read_reg(c, reg);
+		len = reg == STUB_REG_CONF ? 1 : 2;
+		for (j = 0; j < m->len; j++)
+			m->buf[j] = j >= len ? 0xff
+			            : j == len - 1 ? val & 0xff : val >> 8;
+	}
+
+	spin_unlock(&c->lock);
+	return num;
+}
+
+static u32 stub_func(struct i2c_adapter *adapter)
+{
+	return I2C_FUNC_I2C | I2C_FUNC_SMBUS_QUICK |
+	       I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WORD_DATA;
+}
+
+static struct i2c_algorithm stub_algorithm = {
+	.name		= "LM77 stub algorithm",
+	.id		= I2C_ALGO_SMBUS,
+	.master_xfer	= stub_master_xfer,
+	.smbus_xfer	= stub_xfer,
+	.functionality	= stub_func,
+};
+
+static struct i2c_adapter stub_adapter = {
+	.owner		= THIS_MODULE,
+	.name		= "LM77 stub adapter",
+	.id		= I2C_ALGO_SMBUS,
+	.algo		= &stub_algorithm,
+};
+
+static int stub_read_proc(char *page, char **start, off_t off, int count,
+			  int *eof, void *private)
+{
+	struct stub_chip *c = &stub_chip;
+	int len;
+
+	spin_lock(&c->lock);
+	len = sprintf(page, "addr 0x%02x\ntemp %d\nlatency %d\nfail_every %d\n"
+	              "xfers %lu\nreads %lu\nwrites %lu\nquick %lu\n"
+	              "failed %lu\nnak %lu\ni2c %lu\npointer_writes %lu\n"
+	              "pointer %d\nregs %04x %02x %04x %04x %04x %04x\n",
+	              addr, STUB_TEMP(c->reg[STUB_REG_TEMP]) * 500, latency,
+	              fail_every, c->xfers, c->reads, c->writes, c->quick,
+	              c->failed, c->nak, c->i2c, c->pointer_writes,
+	              c->pointer, c->reg[0], c->reg[1], c->reg[2],
+	              c->reg[3], c->reg[4], c->reg[5]);
+	spin_unlock(&c->lock);
+
+	if (off >= len) {
+		*eof = 1;
+		return 0;
+	}
+	*start = page + off;
+	len -= off;
+	if (len > count)
+		len = count;
+	else
+		*eof = 1;
+	return len;
+}
+
+static int stub_write_proc(struct file *file, const char *buffer,
+			   unsigned long count, void *private)
+{
+	struct stub_chip *c = &stub_chip;
+	char buf[32], *p;
+	long val;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, buffer, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	for (p = buf; *p && !isspace(*p); p++)
+		;
+	if (*p)
+		*p++ = '\0';
+	val = simple_strtol(p, NULL, 0);
+
+	spin_lock(&c->lock);
+	if (!strcmp(buf, "temp"))
+		stub_set_temp(c, val);
+	else if (!strcmp(buf, "latency"))
+		latency = val < 0 ? 0 : val;
+	else if (!strcmp(buf, "fail_every"))
+		fail_every = val < 0 ? 0 : val;
+	else if (!strcmp(buf, "reset"))
+		c->xfers = c->reads = c->writes = c->quick = c->failed =
+		c->nak = c->i2c = c->pointer_writes = 0;
+	else {
+		spin_unlock(&c->lock);
+		return -EINVAL;
+	}
+	spin_unlock(&c->lock);
+	return count;
+}
+
+static int __init stub_init(void)
+{
+	struct proc_dir_entry *e;
+	int err;
+
+	if (addr < 0x03 || addr > 0x77) {
+		printk(KERN_ERR "lm77-stub.o: invalid address 0x%02x\n", addr);
+		return -EINVAL;
+	}
+	stub_set_temp(&stub_chip, temp);
+
+	if ((err = i2c_add_adapter(&stub_adapter))) {
+		printk(KERN_ERR "lm77-stub.o: cannot register adapter\n");
+		return err;
+	}
+
+	if ((e = create_proc_entry("driver/lm77-stub", 0644, NULL))) {
+		e->read_proc = stub_read_proc;
+		e->write_proc = stub_write_proc;
+	} else
+		printk(KERN_WARNING "lm77-stub.o: cannot create "
+		       "/proc/driver/lm77-stub\n");
+	return 0;
+}
+
+static void __exit stub_exit(void)
+{
+	remove_proc_entry("driver/lm77-stub", NULL);
+	i2c_del_adapter(&stub_adapter);
+}
+
+MODULE_AUTHOR("Michael Renzmann <mrenzmann@otaku42.de>");
+MODULE_DESCRIPTION("Simulated LM77 for testing lm77.o");
+MODULE_LICENSE("GPL");
+
+module_init(stub_init);
+module_exit(stub_exit);
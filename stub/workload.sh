@@ -0,0 +1,92 @@
+#!/bin/sh
+# Scripted workloads for lm77.o on the simulated adapter of lm77-stub.o.
+#
+# usage: workload.sh path/to/lm77.o [lm77.o parameters...]
+#
+# Environment: LATENCY (us per transfer, default 100), FAIL (fail every
+# n-th transfer, default 0), READS (proc reads per run, default 1000),
+# WRITES (limit writes, default 100), SECS (refresh run, default 10).
+# Needs root, i2c-core and i2c-proc loaded, and a date that knows %N.
+
+LM77=${1:?usage: $0 path/to/lm77.o [parameters]}
+shift
+STUB_DIR=$(dirname "$0")
+LATENCY=${LATENCY:-100}
+FAIL=${FAIL:-0}
+READS=${READS:-1000}
+WRITES=${WRITES:-100}
+SECS=${SECS:-10}
+CTL=/proc/driver/lm77-stub
+
+now_us() {
+	echo $(($(date +%s%N) / 1000))
+}
+
+# Transfer counter of the stub
+xfers() {
+	sed -n 's/^xfers //p' $CTL
+}
+
+rmmod lm77 2>/dev/null
+rmmod lm77-stub 2>/dev/null
+insmod "$STUB_DIR/lm77-stub.o" latency=$LATENCY fail_every=$FAIL || exit 1
+
+echo "latency ${LATENCY}us, fail_every $FAIL"
+
+# Detection. The stub only counts the transfers on its own bus, the
+# probes of the addresses it does not answer at included.
+echo reset > $CTL
+t0=$(now_us)
+insmod "$LM77" "$@" || exit 1
+t1=$(now_us)
+echo "detect: $(((t1 - t0) / 1000)) ms, $(xfers) transfers"
+
+BUS=$(sed -n 's/^i2c-\([0-9]*\).*LM77 stub adapter.*/\1/p' /proc/bus/i2c)
+DIR=$(ls -d /proc/sys/dev/sensors/lm77-i2c-$BUS-* 2>/dev/null | head -1)
+if [ -z "$DIR" ]; then
+	echo "no lm77 client on bus $BUS" >&2
+	exit 1
+fi
+
+# Transfers per proc read, with the cache settings given to lm77.o
+echo reset > $CTL
+t0=$(now_us)
+i=0
+while [ $i -lt $READS ]; do
+	cat $DIR/temp $DIR/alarms >/dev/null
+	i=$((i + 1))
+done
+t1=$(now_us)
+echo "proc read: $READS reads of temp+alarms in $(((t1 - t0) / 1000)) ms," \
+     "$(xfers) transfers"
+
+# Refresh throughput: with the shortest cache lifetime, every read after
+# a conversion time refreshes
+echo 100 0 > $DIR/update_interval
+echo reset > $CTL
+n=0
+t0=$(now_us)
+end=$((t0 + SECS * 1000000))
+while [ $(now_us) -lt $end ]; do
+	cat $DIR/temp >/dev/null
+	n=$((n + 1))
+done
+t1=$(now_us)
+echo "refresh: $n reads in $(((t1 - t0) / 1000)) ms, $(xfers) transfers," \
+     "$(($(xfers) * 1000000 / (t1 - t0))) transfers/s"
+
+# Limit writes, alternating between two values so that every one of
+# them reaches the chip
+echo reset > $CTL
+t0=$(now_us)
+i=0
+while [ $i -lt $WRITES ]; do
+	echo $((80 + i % 2)) > $DIR/temp_crit
+	i=$((i + 1))
+done
+t1=$(now_us)
+echo "limit write: $(((t1 - t0) / WRITES)) us per write," \
+     "$(xfers) transfers for $WRITES writes"
+
+rmmod lm77
+rmmod lm77-stub
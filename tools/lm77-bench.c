@@ -0,0 +1,502 @@
+/*
+    lm77-bench.c - Concurrent reader benchmark for lm77.o
+    Copyright (c) 2005 - 2007  Michael Renzmann <mrenzmann@otaku42.de>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+    Runs N reader threads against one client, optionally with a writer
+    that changes temp_crit through the sysctl interface all the while,
+    and reports reads per second and read latency percentiles per
+    interface. With a driver built with LM77_STATS it also reports bus
+    transfers per read and lock contention, from the difference of
+    /proc/driver/lm77/stats over the run. Without it, the transfer count
+    of the simulated adapter in /proc/driver/lm77-stub is used if that is
+    loaded.
+
+    Readers take turns over the interfaces given with -k:
+      temp, alarms   the sysctl files, read again from offset 0
+      snapshot       the LM77_IOC_SNAPSHOT ioctl on the node given with -c
+      history        the newest entry of the history ring, mapped from
+                     the history node given with -m
+
+    The -r, -p and -b options make it a regression gate: the exit status
+    is 1 if the run was slower, had a higher 99th percentile or needed
+    more bus transfers per read than given.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "../lm77.h"
+
+#define STATS_FILE "/proc/driver/lm77/stats"
+#define STUB_FILE "/proc/driver/lm77-stub"
+
+enum { K_TEMP, K_ALARMS, K_SNAPSHOT, K_HISTORY, K_WRITE, KINDS };
+static const char *kind_name[KINDS] = {
+	"temp", "alarms", "snapshot", "history", "write"
+};
+
+/* Latencies in ns, in 16 linear steps per power of two. That keeps the
+   error of a percentile below 1/16 at any scale. */
+#define SUB_BITS 4
+#define SUB (1 << SUB_BITS)
+#define BUCKETS (64 * SUB)
+
+struct hist {
+	unsigned long count;
+	unsigned long long max;
+	unsigned long b[BUCKETS];
+};
+
+static int bucket(unsigned long long v)
+{
+	int e = 63 - __builtin_clzll(v | 1);
+
+	if (v < SUB)
+		return v;
+	return (e - SUB_BITS + 1) * SUB + ((v >> (e - SUB_BITS)) & (SUB - 1));
+}
+
+static unsigned long long bucket_value(int i)
+{
+	if (i < SUB)
+		return i;
+	return (unsigned long long)(SUB + i % SUB) << (i / SUB - 1);
+}
+
+static void hist_add(struct hist *h, unsigned long long v)
+{
+	h->count++;
+	h->b[bucket(v)]++;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void hist_merge(struct hist *to, const struct hist *from)
+{
+	int i;
+
+	to->count += from->count;
+	for (i = 0; i < BUCKETS; i++)
+		to->b[i] += from->b[i];
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+/* In ns, 0 for an empty histogram */
+static unsigned long long hist_pct(const struct hist *h, double pct)
+{
+	unsigned long want = h->count * pct / 100.0, seen = 0;
+	int i;
+
+	if (!h->count)
+		return 0;
+	for (i = 0; i < BUCKETS; i++)
+		if ((seen += h->b[i]) > want)
+			return bucket_value(i);
+	return h->max;
+}
+
+struct counters {
+	int found;
+	unsigned long long reads, writes, errors, hits, misses, waits;
+	unsigned long long repeats, contended, retries, lock_wait;
+};
+
+struct reader {
+	pthread_t thread;
+	int id;
+	struct hist h[KINDS];
+	unsigned long errors;
+};
+
+static const char *dir, *ctl_dev, *hist_dev;
+static int kinds[KINDS], nkinds;
+static volatile int stop;
+static pthread_barrier_t start;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int open_file(const char *dir, const char *name, int flags)
+{
+	char path[512];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((fd = open(path, flags)) < 0) {
+		fprintf(stderr, "lm77-bench: %s: %s\n", path, strerror(errno));
+		exit(2);
+	}
+	return fd;
+}
+
+static int kinds_has(int k)
+{
+	int i;
+
+	for (i = 0; i < nkinds; i++)
+		if (kinds[i] == k)
+			return 1;
+	return 0;
+}
+
+/* Newest entry of the history ring, following the protocol in lm77.h */
+static int read_history(const struct lm77_history *hist,
+			struct lm77_history_entry *e)
+{
+	__u32 head;
+
+	do {
+		head = hist->head;
+		__sync_synchronize();
+		if (!head)
+			return -1;
+		*e = hist->entry[(head - 1) & (hist->size - 1)];
+		__sync_synchronize();
+	} while (hist->head - head >= hist->size);
+	return 0;
+}
+
+static void *reader_main(void *arg)
+{
+	struct reader *r = arg;
+	int fd[KINDS], ctl = -1, i, k, ret;
+	const struct lm77_history *hist = NULL;
+	struct lm77_snapshot snap;
+	struct lm77_history_entry e;
+	unsigned long long t;
+	char buf[128];
+	long pg = sysconf(_SC_PAGESIZE);
+
+	for (i = 0; i < nkinds; i++) {
+		k = kinds[i];
+		if (k == K_TEMP || k == K_ALARMS)
+			fd[k] = open_file(dir, kind_name[k], O_RDONLY);
+	}
+	if (kinds_has(K_SNAPSHOT) && (ctl = open(ctl_dev, O_RDONLY)) < 0) {
+		fprintf(stderr, "lm77-bench: %s: %s\n", ctl_dev,
+		        strerror(errno));
+		exit(2);
+	}
+	if (kinds_has(K_HISTORY)) {
+		int hfd = open(hist_dev, O_RDONLY);
+		const struct lm77_history *h;
+		size_t len;
+
+		if (hfd < 0 || (h = mmap(NULL, pg, PROT_READ, MAP_SHARED,
+		                         hfd, 0)) == MAP_FAILED) {
+			fprintf(stderr, "lm77-bench: %s: %s\n", hist_dev,
+			        strerror(errno));
+			exit(2);
+		}
+		len = sizeof(*h) + h->size * sizeof(h->entry[0]);
+		len = (len + pg - 1) / pg * pg;
+		munmap((void *)h, pg);
+		hist = mmap(NULL, len, PROT_READ, MAP_SHARED, hfd, 0);
+		if (hist == MAP_FAILED || hist->magic != LM77_HISTORY_MAGIC) {
+			fprintf(stderr, "lm77-bench: %s: not a history node\n",
+			        hist_dev);
+			exit(2);
+		}
+		close(hfd);
+	}
+
+	pthread_barrier_wait(&start);
+
+	/* Readers start at different interfaces, so that all of them are
+	   busy at any time */
+	for (i = r->id; !stop; i++) {
+		k = kinds[i % nkinds];
+		t = now_ns();
+		switch (k) {
+		case K_TEMP:
+		case K_ALARMS:
+			ret = lseek(fd[k], 0, SEEK_SET) < 0 ? -1
+			      : read(fd[k], buf, sizeof(buf));
+			break;
+		case K_SNAPSHOT:
+			ret = ioctl(ctl, LM77_IOC_SNAPSHOT, &snap);
+			break;
+		default:
+			ret = read_history(hist, &e);
+			break;
+		}
+		t = now_ns() - t;
+		if (ret < 0)
+			r->errors++;
+		else
+			hist_add(&r->h[k], t);
+	}
+	return NULL;
+}
+
+struct writer {
+	pthread_t thread;
+	int interval_ms;
+	struct hist h;
+	unsigned long errors;
+	char orig[64];
+	const char *fmt;
+	double step;		/* Half a degree in the units of the file */
+};
+
+/* Move temp_crit by half a degree and back, so that every write has to
+   reach the chip. The original value is put back at the end. */
+static void *writer_main(void *arg)
+{
+	struct writer *w = arg;
+	struct timespec ts = { w->interval_ms / 1000,
+	                       (w->interval_ms % 1000) * 1000000L };
+	unsigned long long t;
+	double crit = atof(w->orig);
+	char buf[64];
+	int fd = open_file(dir, "temp_crit", O_WRONLY), n, i;
+
+	pthread_barrier_wait(&start);
+	for (i = 0; !stop; i++) {
+		n = snprintf(buf, sizeof(buf), w->fmt,
+		             crit + (i & 1 ? w->step : 0));
+		t = now_ns();
+		if (lseek(fd, 0, SEEK_SET) < 0 || write(fd, buf, n) != n)
+			w->errors++;
+		else
+			hist_add(&w->h, now_ns() - t);
+		nanosleep(&ts, NULL);
+	}
+	if (lseek(fd, 0, SEEK_SET) < 0
+	    || write(fd, w->orig, strlen(w->orig)) < 0)
+		fprintf(stderr, "lm77-bench: cannot restore temp_crit %s",
+		        w->orig);	/* orig ends in a newline */
+	close(fd);
+	return NULL;
+}
+
+/* The counters of the client in dir, i.e. .../lm77-i2c-<bus>-<addr> */
+static void read_counters(struct counters *c)
+{
+	const char *base = strrchr(dir, '/') ? strrchr(dir, '/') + 1 : dir;
+	char line[512];
+	int bus, addr, b, a;
+	FILE *f;
+
+	memset(c, 0, sizeof(*c));
+	if (sscanf(base, "lm77-i2c-%d-%x", &bus, &addr) != 2)
+		bus = addr = -1;
+
+	if ((f = fopen(STATS_FILE, "r"))) {
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "%d 0x%x reads %llu writes %llu "
+			           "errors %llu hits %llu misses %llu "
+			           "waits %llu repeats %llu contended %llu "
+			           "retries %llu lock_wait %llu", &b, &a,
+			           &c->reads, &c->writes, &c->errors, &c->hits,
+			           &c->misses, &c->waits, &c->repeats,
+			           &c->contended, &c->retries,
+			           &c->lock_wait) == 12
+			    && (bus < 0 || (b == bus && a == addr))) {
+				c->found = 2;
+				break;
+			}
+		fclose(f);
+	}
+	if (c->found || !(f = fopen(STUB_FILE, "r")))
+		return;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "xfers %llu", &c->reads) == 1)
+			c->found = 1;
+	fclose(f);
+}
+
+static void print_row(const char *name, const struct hist *h, double secs)
+{
+	printf("%-9s %10lu %10.0f %9.1f %9.1f %9.1f %9.1f\n", name, h->count,
+	       h->count / secs, hist_pct(h, 50) / 1e3, hist_pct(h, 90) / 1e3,
+	       hist_pct(h, 99) / 1e3, h->max / 1e3);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+	"usage: lm77-bench [options] /proc/sys/dev/sensors/lm77-i2c-<bus>-<addr>\n"
+	"  -n N       reader threads (default 4)\n"
+	"  -t SECS    run time (default 10)\n"
+	"  -k LIST    interfaces to read, from temp, alarms, snapshot and\n"
+	"             history (default temp,alarms)\n"
+	"  -c DEV     any device node of the client, for snapshot\n"
+	"  -m DEV     history device node of the client, for history\n"
+	"  -w MS      write temp_crit every MS ms (default 100, 0 = never)\n"
+	"  -r N       fail below N reads per second\n"
+	"  -p US      fail if the 99th percentile is above US microseconds\n"
+	"  -b N       fail above N bus transfers per read\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	int nreaders = 4, secs = 10, interval_ms = 100, i, k, opt, fail = 0;
+	double min_rate = 0, max_p99 = 0, max_xfers = 0, elapsed, xfers = 0;
+	char def_list[] = "temp,alarms", *list = def_list, *tok;
+	struct reader *readers;
+	struct writer w;
+	struct hist all, kind[KINDS];
+	struct counters before, after;
+	unsigned long long t0, errors = 0;
+
+	while ((opt = getopt(argc, argv, "n:t:k:c:m:w:r:p:b:")) != -1) {
+		switch (opt) {
+		case 'n': nreaders = atoi(optarg); break;
+		case 't': secs = atoi(optarg); break;
+		case 'k': list = optarg; break;
+		case 'c': ctl_dev = optarg; break;
+		case 'm': hist_dev = optarg; break;
+		case 'w': interval_ms = atoi(optarg); break;
+		case 'r': min_rate = atof(optarg); break;
+		case 'p': max_p99 = atof(optarg); break;
+		case 'b': max_xfers = atof(optarg); break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || nreaders < 1 || secs < 1)
+		usage();
+	dir = argv[optind];
+
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		for (k = 0; k < K_WRITE && strcmp(tok, kind_name[k]); k++)
+			;
+		if (k == K_WRITE || kinds_has(k))
+			usage();
+		kinds[nkinds++] = k;
+	}
+	if (!nkinds || (kinds_has(K_SNAPSHOT) && !ctl_dev)
+	    || (kinds_has(K_HISTORY) && !hist_dev))
+		usage();
+
+	memset(&w, 0, sizeof(w));
+	w.interval_ms = interval_ms;
+	if (interval_ms > 0) {
+		int fd = open_file(dir, "temp_crit", O_RDONLY);
+
+		if (read(fd, w.orig, sizeof(w.orig) - 1) <= 0) {
+			fprintf(stderr, "lm77-bench: cannot read temp_crit\n");
+			return 2;
+		}
+		close(fd);
+		/* The file is in degrees with one or three decimals, or
+		   with millidegrees=1 in plain integer millidegrees */
+		tok = strchr(w.orig, '.');
+		w.fmt = !tok ? "%.0f\n"
+		        : strspn(tok + 1, "0123456789") == 3 ? "%.3f\n"
+		        : "%.1f\n";
+		w.step = tok ? 0.5 : 500;
+	}
+
+	if (!(readers = calloc(nreaders, sizeof(*readers)))) {
+		perror("lm77-bench");
+		return 2;
+	}
+	pthread_barrier_init(&start, NULL, nreaders + (interval_ms > 0) + 1);
+	for (i = 0; i < nreaders; i++) {
+		readers[i].id = i;
+		pthread_create(&readers[i].thread, NULL, reader_main,
+		               &readers[i]);
+	}
+	if (interval_ms > 0)
+		pthread_create(&w.thread, NULL, writer_main, &w);
+
+	read_counters(&before);
+	pthread_barrier_wait(&start);
+	t0 = now_ns();
+	sleep(secs);
+	stop = 1;
+	for (i = 0; i < nreaders; i++)
+		pthread_join(readers[i].thread, NULL);
+	elapsed = (now_ns() - t0) / 1e9;
+	if (interval_ms > 0)
+		pthread_join(w.thread, NULL);
+	read_counters(&after);
+
+	memset(&all, 0, sizeof(all));
+	memset(kind, 0, sizeof(kind));
+	for (i = 0; i < nreaders; i++) {
+		for (k = 0; k < K_WRITE; k++) {
+			hist_merge(&kind[k], &readers[i].h[k]);
+			hist_merge(&all, &readers[i].h[k]);
+		}
+		errors += readers[i].errors;
+	}
+
+	printf("%d readers, %.1f s", nreaders, elapsed);
+	if (interval_ms > 0)
+		printf(", temp_crit written every %d ms", interval_ms);
+	printf("\n%-9s %10s %10s %9s %9s %9s %9s\n", "", "reads", "reads/s",
+	       "p50 us", "p90 us", "p99 us", "max us");
+	for (i = 0; i < nkinds; i++)
+		print_row(kind_name[kinds[i]], &kind[kinds[i]], elapsed);
+	print_row("all", &all, elapsed);
+	if (interval_ms > 0)
+		print_row("write", &w.h, elapsed);
+	if (errors || w.errors)
+		printf("failed: %llu reads, %lu writes\n", errors, w.errors);
+
+	/* Transfers include those of the writer and of the sampler thread */
+	if (after.found && all.count) {
+		xfers = (double)(after.reads + after.writes - before.reads
+		                 - before.writes) / all.count;
+		printf("bus transfers per read: %.4f%s\n", xfers,
+		       after.found == 1 ? " (" STUB_FILE ")" : "");
+	} else
+		printf("bus transfers per read: unknown, no stats\n");
+	if (after.found == 2)
+		printf("lock contended %llu times, waited %llu cycles; "
+		       "misses %llu, waits %llu, retries %llu\n",
+		       after.contended - before.contended,
+		       after.lock_wait - before.lock_wait,
+		       after.misses - before.misses,
+		       after.waits - before.waits,
+		       after.retries - before.retries);
+
+	if (min_rate && all.count / elapsed < min_rate) {
+		printf("FAIL: %.0f reads/s, want %.0f\n", all.count / elapsed,
+		       min_rate);
+		fail = 1;
+	}
+	if (max_p99 && hist_pct(&all, 99) / 1e3 > max_p99) {
+		printf("FAIL: p99 %.1f us, want %.1f\n",
+		       hist_pct(&all, 99) / 1e3, max_p99);
+		fail = 1;
+	}
+	if (max_xfers && (!after.found || xfers > max_xfers)) {
+		printf("FAIL: %.4f bus transfers per read, want %.4f\n", xfers,
+		       max_xfers);
+		fail = 1;
+	}
+	return fail;
+}